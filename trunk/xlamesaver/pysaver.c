@@ -35,11 +35,37 @@ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 -----------------------------------------------------------------------------*/
 #include <Python.h>
+#include <pythread.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/sync.h>
+#include <X11/extensions/dpms.h>
+#include <X11/extensions/XShm.h>
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#ifdef HAVE_XRECORD
+#include <X11/Xproto.h>
+#include <X11/extensions/record.h>
+#endif
+#ifdef HAVE_XDAMAGE
+#include <X11/extensions/Xdamage.h>
+#endif
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <limits.h>
+#endif
 
-#define EVENT_MASK ExposureMask | ButtonPressMask | PointerMotionMask
+#define EVENT_MASK ExposureMask | ButtonPressMask | PointerMotionMask | \
+                   VisibilityChangeMask
 
 /*---------------------------------------------------------------------------*/
 #ifdef MYDEBUG
@@ -49,25 +75,173 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 /*---------------------------------------------------------------------------*/
-/* Error handlers global variables
+/* Where each pane lies: its X screen, its geometry on it, and the name
+   of the RandR output it covers (empty for whole screen panes)
  */
-typedef int (*XErrorHandler) (Display *, XErrorEvent *);
-static XErrorHandler xhdlr;
-static int xstatus;
+typedef struct {
+  int screen;
+  XRectangle geom;
+  char name[32];
+  Visual * visual;
+  int depth;
+} PaneLayout;
+
+/* What pysaver_pool() gathers for each pane while draining the events
+ */
+typedef struct {
+  int touched, moved, hit, nrects, maxrects;
+  int x, y;
+  XRectangle * rects;
+} PaneBatch;
+
+/* MIT-SHM image backing a pane, shared with Python as a writable
+   buffer: the memory stays mapped as long as some Python object refers
+   to it, even once released from the display (image is then NULL)
+ */
+typedef struct {
+  PyObject_HEAD
+  XShmSegmentInfo shminfo;
+  XImage * image;
+  Py_ssize_t size;
+  int presented;
+} SurfaceObject;
+
+/* A fade pending or in progress on a pane: `src' holds what the screen
+   showed, `start' is zero until the pane gets activated
+ */
+typedef struct {
+  unsigned char * src;
+  double start, duration;
+} PaneFade;
+
+/* Counters and log2 histograms kept by each instance (see stats()):
+   bucket k counts the values from 2^(k-1) to 2^k - 1, bucket 0 zeros
+ */
+#define STATS_BUCKETS 24
+
+typedef struct {
+  unsigned long count, total;
+  unsigned long hist[STATS_BUCKETS];
+} StatsHistogram;
+
+enum { STATS_SYNC, STATS_POINTER, STATS_KEYMAP, STATS_COUNTER, STATS_DPMS,
+       STATS_IMAGE, STATS_RANDR, STATS_EVENTS, STATS_CALLBACKS, STATS_EXPOSE,
+       STATS_COUNT };
+
+static const char * stats_names[STATS_COUNT] = {
+  "sync", "pointer", "keymap", "counter", "dpms", 
+  "image", "randr", "events", "callbacks", "expose"
+};
 
-/* Global variables used to manipulates panes 
+/* Everything related to a given display connection: module-level
+   functions work on a default instance of this type
  */
-static Display * dpy;
-static int nroots, hyst, * pstates, * pxy;
-static Window * roots, * panes;
-static GC * gc;
-static Cursor * pcursors;
-static PyObject ** pcallbacks, ** pkeywords;
+typedef struct DisplayObject {
+  PyObject_HEAD
+
+  /* Connection, and X errors seen on it: any of them, and the serial
+     of the first one at or after `checked', if not zero (see
+     pysaver_check_begin()) */
+  Display * dpy;
+  int xstatus;
+  unsigned long checked, failed;
+
+  /* Set while the interpreter lock is released around a round trip:
+     other threads must then leave this instance alone */
+  int inuse;
+
+  /* Panes */
+  int nroots, hyst, * pstates, * pxy;
+  Window * roots, * panes;
+  GC * gc;
+  Cursor * pcursors;
+  PyObject ** pcallbacks, ** pkeywords, * pvisuals;
+  PaneLayout * playout;
+  int forced;
+  Atom hints_atom;
+
+  /* Panes are created on first activation and released after `release'
+     seconds unactivated (since `pidle') when it is not negative, and
+     eagerly created and kept otherwise */
+  double release, * pidle;
+  int randr_event, prelayout, dpms_enabled;
+
+  /* Whether the activated panes are not fully obscured, as last told by
+     VisibilityNotify: their own subwindows never obscure them */
+  int * pvisible;
+
+  /* MIT-SHM surfaces, created on demand by surface() */
+  int shm;
+  SurfaceObject ** psurfaces;
+  PaneFade * pfades;
+  int nfading;
+
+  /* Hack windows inside the panes: the one shown, and the one warming
+     up beneath it until swapped in, `pready' once it drew something
+     and `pframes' times since (as reported by DAMAGE, when available:
+     see standby()) */
+  Window * pshown, * pstandby;
+  XID * pdamage;
+  int * pready, * pframes, damage_event;
+
+  /* Instrumentation: activation times of the panes not exposed yet */
+  StatsHistogram stats[STATS_COUNT];
+  double * pexposing;
+
+  /* Window to pane lookup table (open addressing, linear probing: panes
+     IDs are allocated sequentially, so their low bits make a fine hash) */
+  int * ptable, ptable_mask;
+
+  /* Per-pane gathering of events, see pysaver_pool() */
+  PaneBatch * pbatch;
+  int * ptouched, ntouched;
+
+  /* Bumped whenever the panes are freed, as desactivation callbacks
+     may do through disconnect() or relayout(): see pysaver_pool() */
+  unsigned long playouts;
+
+  /* Server-side idle time tracking, through the XSync IDLETIME
+     counter: fired alarms are kept until collected by alarms() */
+  int sync_event;
+  XSyncCounter idle_counter;
+  XSyncAlarm * fired;
+  int nfired, maxfired;
+
+  /* Input capture through the RECORD extension, on a connection of its
+     own: panes that saw input are flagged until collected by inputs() */
+  Display * rdpy;
+  XID rcontext;
+  Window rroot;
+  int rx, ry, * pinputs;
+
+  /* Connected instances are chained, for the error handler */
+  struct DisplayObject * next;
+} DisplayObject;
+
+static PyTypeObject DisplayType, SurfaceType;
+static DisplayObject * pdefault;
 
 /*---------------------------------------------------------------------------*/
+/* Error handlers global variables: the handler is shared by all the
+   connections, and looks up the instance the error belongs to
+ */
+typedef int (*XErrorHandler) (Display *, XErrorEvent *);
+static XErrorHandler xhdlr;
+static DisplayObject * pconnected;
+static PyThread_type_lock plock;
+
 static int 
 pysaver_error(Display * dpy , XErrorEvent * xev) {
-  xstatus = 1;
+  DisplayObject * d;
+
+  PyThread_acquire_lock(plock, WAIT_LOCK);
+  for (d = pconnected; d && d->dpy != dpy; d = d->next);
+  if (d) {
+    d->xstatus = 1;
+    if (d->checked && !d->failed && xev->serial >= d->checked)
+      d->failed = xev->serial;
+  }
+  PyThread_release_lock(plock);
 #ifndef MYDEBUG
   return 0;
 #else
@@ -75,6 +249,109 @@ pysaver_error(Display * dpy , XErrorEvent * xev) {
 #endif
 }
 
+static void
+pysaver_register(DisplayObject * self)
+{
+  PyThread_acquire_lock(plock, WAIT_LOCK);
+  if (!pconnected)
+    xhdlr = XSetErrorHandler(pysaver_error);
+  self->next = pconnected;
+  pconnected = self;
+  PyThread_release_lock(plock);
+}
+
+static void
+pysaver_unregister(DisplayObject * self)
+{
+  DisplayObject ** d;
+
+  PyThread_acquire_lock(plock, WAIT_LOCK);
+  for (d = &pconnected; *d && *d != self; d = &(*d)->next);
+  if (*d) *d = self->next;
+  if (!pconnected)
+    XSetErrorHandler(xhdlr);
+  PyThread_release_lock(plock);
+}
+
+/* Release the interpreter lock around blocking Xlib calls
+ */
+#define PYSAVER_UNLOCKED(self, stmt) \
+  { \
+    (self)->inuse = 1; \
+    Py_BEGIN_ALLOW_THREADS \
+    stmt; \
+    Py_END_ALLOW_THREADS \
+    (self)->inuse = 0; \
+  }
+
+/*---------------------------------------------------------------------------*/
+/* Instrumentation: a monotonic clock read and a few additions per
+   sample, cheap enough to be always on
+ */
+static double
+pysaver_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+pysaver_stats_add(DisplayObject * self, int kind, unsigned long value)
+{
+  int k;
+  StatsHistogram * h = &self->stats[kind];
+
+  for (k = 0; k < STATS_BUCKETS - 1 && value >> k; ++k);
+  ++h->count;
+  h->total += value;
+  ++h->hist[k];
+}
+
+/* Account for the microseconds elapsed since `start'
+ */
+static void
+pysaver_stats_since(DisplayObject * self, int kind, double start)
+{
+  pysaver_stats_add(self, kind, 
+		    (unsigned long)((pysaver_now() - start) * 1e6));
+}
+
+#define PYSAVER_TIMED(self, kind, stmt) \
+  { \
+    double start = pysaver_now(); \
+    stmt; \
+    pysaver_stats_since(self, kind, start); \
+  }
+
+/* Timed round trip, without the interpreter lock
+ */
+#define PYSAVER_ROUNDTRIP(self, kind, stmt) \
+  PYSAVER_UNLOCKED(self, PYSAVER_TIMED(self, kind, stmt))
+
+/*---------------------------------------------------------------------------*/
+/* Checked requests, xcb style: the serial of a request (NextRequest()
+   right before issuing it) is its cookie. A whole batch of requests is
+   checked at once: pysaver_check_end() makes a single round trip, and
+   returns the serial of the first request of the batch that failed,
+   or zero: it belongs to the latest cookie not after it.
+ */
+static void
+pysaver_check_begin(DisplayObject * self)
+{
+  self->failed = 0;
+  self->checked = NextRequest(self->dpy);
+}
+
+static unsigned long
+pysaver_check_end(DisplayObject * self)
+{
+  PYSAVER_ROUNDTRIP(self, STATS_SYNC, XSync(self->dpy, False));
+  self->checked = 0;
+  return self->failed;
+}
+
 /*---------------------------------------------------------------------------*/
 /* No decoration motif hints for panes 
  */
@@ -111,44 +388,350 @@ PYSAVER_BLOCK_UNBLOCK(unblock, UNBLOCK)
 
 #undef PYSAVER_BLOCK_UNBLOCK
 
+#ifdef __linux__
+/* Signals read from a file descriptor: they are blocked for good
+ */
+static PyObject *
+pysaver_signalfd(PyObject * self, PyObject * args)
+{
+  int i, n, fd;
+  long signo;
+  sigset_t mask;
+  PyObject * signals, * seq;
+
+  if (!PyArg_ParseTuple(args, "O", &signals)) return NULL;
+  if (!(seq = PySequence_Fast(signals, "signals is not a sequence")))
+    return NULL;
+
+  sigemptyset(&mask);
+  for (i = 0, n = PySequence_Fast_GET_SIZE(seq); i < n; ++i) {
+    signo = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+    if (signo == -1 && PyErr_Occurred()) {
+      Py_DECREF(seq);
+      return NULL;
+    }
+    if (sigaddset(&mask, (int)signo) != 0) {
+      Py_DECREF(seq);
+      return PyErr_SetFromErrno(PyExc_OSError);
+    }
+  }
+  Py_DECREF(seq);
+
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0 ||
+      (fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+    return PyErr_SetFromErrno(PyExc_OSError);
+  return Py_BuildValue("i", fd);
+}
+
+static PyObject *
+pysaver_signals(PyObject * self, PyObject * args)
+{
+  int fd;
+  ssize_t n;
+  struct signalfd_siginfo info;
+  PyObject * l, * item;
+
+  if (!PyArg_ParseTuple(args, "i", &fd)) return NULL;
+  if (!(l = PyList_New(0))) return NULL;
+
+  while ((n = read(fd, &info, sizeof(info))) == sizeof(info)) {
+    if (!(item = PyInt_FromLong(info.ssi_signo)) || 
+	PyList_Append(l, item) < 0) {
+      Py_XDECREF(item);
+      Py_DECREF(l);
+      return NULL;
+    }
+    Py_DECREF(item);
+  }
+  if (n < 0 && errno != EAGAIN) {
+    Py_DECREF(l);
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+  return l;
+}
+
+/* Files changes, read from a file descriptor as well
+ */
+static PyObject *
+pysaver_inotify(PyObject * self, PyObject * args)
+{
+  int fd;
+
+  if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+    return PyErr_SetFromErrno(PyExc_OSError);
+  return Py_BuildValue("i", fd);
+}
+
+static PyObject *
+pysaver_watch(PyObject * self, PyObject * args)
+{
+  int fd, wd;
+  char * path;
+
+  if (!PyArg_ParseTuple(args, "is", &fd, &path)) return NULL;
+  if ((wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO)) < 0)
+    return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+  return Py_BuildValue("i", wd);
+}
+
+static PyObject *
+pysaver_changes(PyObject * self, PyObject * args)
+{
+  int fd;
+  ssize_t n;
+  char * p;
+  struct inotify_event * ev;
+  union {
+    struct inotify_event ev;	/* For alignment */
+    char buf[4096 + sizeof(struct inotify_event) + NAME_MAX + 1];
+  } u;
+  PyObject * l, * item;
+
+  if (!PyArg_ParseTuple(args, "i", &fd)) return NULL;
+  if (!(l = PyList_New(0))) return NULL;
+
+  while ((n = read(fd, u.buf, sizeof(u.buf))) > 0)
+    for (p = u.buf; p < u.buf + n; 
+	 p += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event *)p;
+      if (!(item = Py_BuildValue("(i, s)", ev->wd, 
+				 (ev->len)?ev->name:"")) ||
+	  PyList_Append(l, item) < 0) {
+	Py_XDECREF(item);
+	Py_DECREF(l);
+	return NULL;
+      }
+      Py_DECREF(item);
+    }
+  if (n < 0 && errno != EAGAIN) {
+    Py_DECREF(l);
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+  return l;
+}
+#endif
+
 /*---------------------------------------------------------------------------*/
 /* Helper functions 
  */
+
+/* (Re)build the window to pane lookup table, as panes come and go
+ */
+static int
+pysaver_table_build(DisplayObject * self)
+{
+  int i, j, size;
+
+  for (size = 4; size < 2*self->nroots; size <<= 1);
+  if (!self->ptable && !(self->ptable = PyMem_New(int, size)))
+    return 0;
+  self->ptable_mask = size - 1;
+  for (i=0; i<size; ++i)
+    self->ptable[i] = -1;
+  for (i=0; i<self->nroots; ++i) {
+    if (!self->panes[i])
+      continue;
+    for (j = self->panes[i] & self->ptable_mask; self->ptable[j] >= 0; 
+	 j = (j+1) & self->ptable_mask);
+    self->ptable[j] = i;
+  }
+  return 1;
+}
+
+static int
+pysaver_pane(DisplayObject * self, Window w)
+{
+  int j;
+  if (!self->ptable)
+    return -1;
+  for (j = w & self->ptable_mask; self->ptable[j] >= 0; 
+       j = (j+1) & self->ptable_mask)
+    if (self->panes[self->ptable[j]] == w)
+      return self->ptable[j];
+  return -1;
+}
+
 static void
-pysaver_xcleanup(void) 
-{ 
+pysaver_panes_free(DisplayObject * self)
+{
   int i;
   
-  if (pcallbacks)
-    for (i=0; i<nroots; ++i)
-      Py_XDECREF(pcallbacks[i]);
+  if (self->pcallbacks)
+    for (i=0; i<self->nroots; ++i)
+      Py_XDECREF(self->pcallbacks[i]);
+
+  if (self->pkeywords)
+    for (i=0; i<self->nroots; ++i)
+      Py_XDECREF(self->pkeywords[i]);
+
+  if (self->pbatch)
+    for (i=0; i<self->nroots; ++i)
+      if (self->pbatch[i].rects)
+	PyMem_Free(self->pbatch[i].rects);
 
-  if (pkeywords)
-    for (i=0; i<nroots; ++i)
-      Py_XDECREF(pkeywords[i]);
+  if (self->psurfaces)
+    for (i=0; i<self->nroots; ++i)
+      Py_XDECREF(self->psurfaces[i]);
+
+  if (self->pfades)
+    for (i=0; i<self->nroots; ++i)
+      if (self->pfades[i].src)
+	PyMem_Free(self->pfades[i].src);
+
+  self->ntouched = 0;
+  ++self->playouts;
 
 #define XCLEANUP(table) if (table) { PyMem_Free(table); table = NULL; }
-  XCLEANUP(roots);
-  XCLEANUP(panes);
-  XCLEANUP(gc);
-  XCLEANUP(pcursors);
-  XCLEANUP(pstates);
-  XCLEANUP(pcallbacks);
-  XCLEANUP(pxy);
+  XCLEANUP(self->roots);
+  XCLEANUP(self->panes);
+  XCLEANUP(self->gc);
+  XCLEANUP(self->pcursors);
+  XCLEANUP(self->pstates);
+  XCLEANUP(self->pcallbacks);
+  XCLEANUP(self->pkeywords);
+  XCLEANUP(self->pxy);
+  XCLEANUP(self->ptable);
+  XCLEANUP(self->pbatch);
+  XCLEANUP(self->ptouched);
+  XCLEANUP(self->playout);
+  XCLEANUP(self->psurfaces);
+  XCLEANUP(self->pfades);
+  XCLEANUP(self->pexposing);
+  XCLEANUP(self->pinputs);
+  XCLEANUP(self->pidle);
+  XCLEANUP(self->pshown);
+  XCLEANUP(self->pstandby);
+  XCLEANUP(self->pdamage);
+  XCLEANUP(self->pready);
+  XCLEANUP(self->pframes);
+  XCLEANUP(self->pvisible);
 #undef XCLEANUP
+  self->nroots = self->nfading = 0;
+}
+
+#ifdef HAVE_XRECORD
+/* Recorded device events are flagged on the pane under the pointer at
+   the time, grabs or not: motion only counts beyond the hysteresis.
+   This runs from pysaver_pool(), without the interpreter lock.
+ */
+static void
+pysaver_record_cb(XPointer closure, XRecordInterceptData * data)
+{
+  int i, type, x, y;
+  Window root;
+  xEvent * ev;
+  PaneLayout * l;
+  DisplayObject * self = (DisplayObject *)closure;
+
+  if (data->category == XRecordFromServer && self->pinputs) {
+    ev = (xEvent *)data->data;
+    type = ev->u.u.type & 0x7f;
+    root = ev->u.keyButtonPointer.root;
+    x = ev->u.keyButtonPointer.rootX;
+    y = ev->u.keyButtonPointer.rootY;
+    if (type != MotionNotify || root != self->rroot ||
+	abs(x - self->rx) > self->hyst || abs(y - self->ry) > self->hyst) {
+      self->rroot = root;
+      self->rx = x;
+      self->ry = y;
+      for (i = 0; i < self->nroots; ++i) {
+	l = &self->playout[i];
+	if (self->roots[i] == root &&
+	    x >= l->geom.x && x < l->geom.x + l->geom.width &&
+	    y >= l->geom.y && y < l->geom.y + l->geom.height) {
+	  self->pinputs[i] = 1;
+	  break;
+	}
+      }
+    }
+  }
+  XRecordFreeData(data);
+}
+
+static void
+pysaver_record_free(DisplayObject * self)
+{
+  if (self->rcontext) {
+    XRecordDisableContext(self->dpy, self->rcontext);
+    XRecordFreeContext(self->dpy, self->rcontext);
+    self->rcontext = 0;
+  }
+  if (self->rdpy) {
+    XCloseDisplay(self->rdpy);
+    self->rdpy = NULL;
+  }
+}
+
+/* Record all the device events: the context is created on the main
+   connection, and enabled on a second one that only carries its data.
+   As for IDLETIME, failing to do so is not an error.
+ */
+static void
+pysaver_record_init(DisplayObject * self)
+{
+  int major, minor;
+  Status ok = 0;
+  Display * rdpy;
+  XRecordClientSpec clients = XRecordAllClients;
+  XRecordRange * range;
+
+  self->rroot = None;
+  if (!XRecordQueryVersion(self->dpy, &major, &minor) ||
+      !(range = XRecordAllocRange()))
+    return;
+  range->device_events.first = KeyPress;
+  range->device_events.last = MotionNotify;
+  self->rcontext = XRecordCreateContext(self->dpy, 0, &clients, 1, 
+					&range, 1);
+  XFree(range);
+  if (!self->rcontext)
+    return;
+
+  PYSAVER_UNLOCKED(self, 
+		   XSync(self->dpy, False); 
+		   rdpy = XOpenDisplay(DisplayString(self->dpy)));
+  if ((self->rdpy = rdpy))
+    ok = XRecordEnableContextAsync(self->rdpy, self->rcontext,
+				   pysaver_record_cb, (XPointer)self);
+  if (!ok || self->xstatus) {
+    pysaver_record_free(self);
+    self->xstatus = 0;
+  }
+  mydebug("Input %srecorded\n", (self->rdpy)?"":"not ");
+}
+#endif
 
-  XCloseDisplay(dpy);
-  dpy = NULL;
-  XSetErrorHandler(xhdlr);
-  xstatus = 0;
+static void
+pysaver_xcleanup(DisplayObject * self) 
+{ 
+#ifdef HAVE_XRECORD
+  pysaver_record_free(self);
+#endif
+  pysaver_panes_free(self);
+  if (self->fired) {
+    PyMem_Free(self->fired);
+    self->fired = NULL;
+  }
+  self->nfired = self->maxfired = 0;
+  self->idle_counter = None;
+  self->hints_atom = None;
+  Py_XDECREF(self->pvisuals);
+  self->pvisuals = NULL;
+
+  pysaver_unregister(self);
+  XCloseDisplay(self->dpy);
+  self->dpy = NULL;
+  self->xstatus = 0;
 }
 
 static int
-pysaver_checkdpy(void)
+pysaver_checkdpy(DisplayObject * self)
 {
-  if (!dpy)
+  if (!self->dpy)
     PyErr_SetString(PyExc_RuntimeError, "not already connected");
-  return dpy!=NULL;
+  else if (self->inuse)
+    PyErr_SetString(PyExc_RuntimeError, "display in use by another thread");
+  return self->dpy!=NULL && !self->inuse;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -172,460 +755,1801 @@ pysaver_display_name(PyObject * self, PyObject * args)
 }
 
 /*---------------------------------------------------------------------------*/
-static PyObject * 
-pysaver_connect(PyObject * self, PyObject * args, PyObject * kw)
+static void
+pysaver_sync_init(DisplayObject * self)
 {
-  static char * kwlist[] = {"name", "visuals", "hysteresis", NULL};
-  int i, n;
-  unsigned int d;
-  char * name = NULL;
-  PyObject * visuals = NULL, * val, * item;
-  Screen * s;
-  XVisualInfo vinfo, * pinfo;
-  Visual * vis;
-  XColor col1, col2;
-  XSetWindowAttributes attrs;
-  Atom hintsAtom = None;
-  MotifWmHints hints;
-  Pixmap bit;
+  int i, n, sync_error;
+  XSyncSystemCounter * counters;
+
+  self->idle_counter = None;
+  if (XSyncQueryExtension(self->dpy, &self->sync_event, &sync_error) &&
+      XSyncInitialize(self->dpy, &i, &n) &&
+      (counters = XSyncListSystemCounters(self->dpy, &n))) {
+    for (i=0; i<n; ++i)
+      if (!strcmp(counters[i].name, "IDLETIME"))
+	self->idle_counter = counters[i].counter;
+    XSyncFreeSystemCounterList(counters);
+  }
+  mydebug("IDLETIME counter: 0x%x\n", (unsigned int)self->idle_counter);
+}
 
-  hyst = 0;
-  if (!PyArg_ParseTupleAndKeywords(args, kw, "|sOi", kwlist, 
-				   &name, &visuals, &hyst))
-    return NULL;
+static int
+pysaver_checksync(DisplayObject * self)
+{
+  if (!pysaver_checkdpy(self)) return 0;
+  if (self->idle_counter == None)
+    PyErr_SetString(PyExc_RuntimeError, "IDLETIME counter unavailable");
+  return self->idle_counter != None;
+}
 
-  if (hyst<0) {
-    PyErr_SetString(PyExc_RuntimeError, "hysteresis cannot be negative");
-    return NULL;
+/*---------------------------------------------------------------------------*/
+/* Panes layout: one pane per X screen or, when asked for and RandR is
+   available, one pane per active CRTC on each screen (cloned outputs
+   thus share their pane)
+ */
+static int
+pysaver_layout_add(DisplayObject * self, int * max, int screen, int x, int y,
+		   unsigned int width, unsigned int height, char * name)
+{
+  PaneLayout * l;
+
+  if (self->nroots == *max) {
+    if (!(l = PyMem_Resize(self->playout, PaneLayout, (*max)?(*max)*2:4)))
+      return 0;
+    self->playout = l;
+    *max = (*max)?(*max)*2:4;
   }
+  l = &self->playout[self->nroots++];
+  l->screen = screen;
+  l->geom.x = x;
+  l->geom.y = y;
+  l->geom.width = width;
+  l->geom.height = height;
+  snprintf(l->name, sizeof(l->name), "%s", (name)?name:"");
+  return 1;
+}
 
-  if (visuals) {
-    if (!PyDict_Check(visuals)) {
-      PyErr_SetString(PyExc_RuntimeError, "visuals is not a dictionary");
-      return NULL;
+static int
+pysaver_layout(DisplayObject * self)
+{
+  int i, found, max = 0;
+  Screen * s;
+#ifdef HAVE_XRANDR
+  int c, failed = 0;
+  XRRScreenResources * res;
+  XRRCrtcInfo * crtc;
+  XRROutputInfo * out;
+#endif
+
+  self->nroots = 0;
+  for (i=0; i<ScreenCount(self->dpy); ++i) {
+    found = 0;
+#ifdef HAVE_XRANDR
+    res = NULL;
+    if (self->randr_event >= 0)
+      PYSAVER_TIMED(self, STATS_RANDR,
+		    res = XRRGetScreenResourcesCurrent(
+		      self->dpy, RootWindow(self->dpy, i)));
+    if (res) {
+      for (c=0; c<res->ncrtc && !failed; ++c) {
+	PYSAVER_TIMED(self, STATS_RANDR,
+		      crtc = XRRGetCrtcInfo(self->dpy, res, res->crtcs[c]));
+	if (!crtc)
+	  continue;
+	if (crtc->mode != None && crtc->noutput > 0) {
+	  PYSAVER_TIMED(self, STATS_RANDR,
+			out = XRRGetOutputInfo(self->dpy, res, 
+					       crtc->outputs[0]));
+	  if (pysaver_layout_add(self, &max, i, crtc->x, crtc->y,
+				 crtc->width, crtc->height,
+				 (out)?out->name:NULL))
+	    ++found;
+	  else
+	    failed = 1;
+	  if (out) XRRFreeOutputInfo(out);
+	}
+	XRRFreeCrtcInfo(crtc);
+      }
+      XRRFreeScreenResources(res);
+      if (failed) return 0;
     }
+#endif
+    s = ScreenOfDisplay(self->dpy, i);
+    if (!found &&
+	!pysaver_layout_add(self, &max, i, 0, 0, 
+			    WidthOfScreen(s), HeightOfScreen(s), NULL))
+      return 0;
+    mydebug("Screen %d: %dx%d, %d pane(s)\n", 
+	    i, WidthOfScreen(s), HeightOfScreen(s), (found)?found:1);
   }
+  return 1;
+}
 
-  if (dpy) {
-    PyErr_SetString(PyExc_RuntimeError, "already connected");
-    return NULL;
+/* Allocate the per-pane structures, once the layout is known
+ */
+static int
+pysaver_panes_alloc(DisplayObject * self)
+{
+  if (!(self->roots      = PyMem_New(Window, self->nroots)) || 
+      !(self->panes      = PyMem_New(Window, self->nroots)) ||
+      !(self->gc         = PyMem_New(GC, self->nroots)) ||
+      !(self->pcursors   = PyMem_New(Cursor, self->nroots)) ||
+      !(self->pstates    = PyMem_New(int, self->nroots)) ||
+      !(self->pcallbacks = PyMem_New(PyObject*, self->nroots)) ||
+      !(self->pkeywords  = PyMem_New(PyObject*, self->nroots)) ||
+      !(self->pxy        = PyMem_New(int, self->nroots*2)) ||
+      !(self->pbatch     = PyMem_New(PaneBatch, self->nroots)) ||
+      !(self->ptouched   = PyMem_New(int, self->nroots)) ||
+      !(self->psurfaces  = PyMem_New(SurfaceObject*, self->nroots)) ||
+      !(self->pfades     = PyMem_New(PaneFade, self->nroots)) ||
+      !(self->pexposing  = PyMem_New(double, self->nroots)) ||
+      !(self->pinputs    = PyMem_New(int, self->nroots)) ||
+      !(self->pidle      = PyMem_New(double, self->nroots)) ||
+      !(self->pshown     = PyMem_New(Window, self->nroots)) ||
+      !(self->pstandby   = PyMem_New(Window, self->nroots)) ||
+      !(self->pdamage    = PyMem_New(XID, self->nroots)) ||
+      !(self->pready     = PyMem_New(int, self->nroots)) ||
+      !(self->pframes    = PyMem_New(int, self->nroots)) ||
+      !(self->pvisible   = PyMem_New(int, self->nroots)))
+    return 0;
+
+  memset((void*)self->panes, 0, sizeof(Window)*self->nroots);
+  memset((void*)self->gc, 0, sizeof(GC)*self->nroots);
+  memset((void*)self->pcursors, 0, sizeof(Cursor)*self->nroots);
+  memset((void*)self->pstates, 0, sizeof(int)*self->nroots);
+  memset((void*)self->pcallbacks, 0, sizeof(PyObject*)*self->nroots);
+  memset((void*)self->pkeywords, 0, sizeof(PyObject*)*self->nroots);
+  memset((void*)self->pxy, 0, sizeof(int)*2*self->nroots);
+  memset((void*)self->pbatch, 0, sizeof(PaneBatch)*self->nroots);
+  memset((void*)self->psurfaces, 0, sizeof(SurfaceObject*)*self->nroots);
+  memset((void*)self->pfades, 0, sizeof(PaneFade)*self->nroots);
+  memset((void*)self->pexposing, 0, sizeof(double)*self->nroots);
+  memset((void*)self->pinputs, 0, sizeof(int)*self->nroots);
+  memset((void*)self->pshown, 0, sizeof(Window)*self->nroots);
+  memset((void*)self->pstandby, 0, sizeof(Window)*self->nroots);
+  memset((void*)self->pdamage, 0, sizeof(XID)*self->nroots);
+  memset((void*)self->pready, 0, sizeof(int)*self->nroots);
+  memset((void*)self->pframes, 0, sizeof(int)*self->nroots);
+  memset((void*)self->pvisible, 0, sizeof(int)*self->nroots);
+  return 1;
+}
+
+/* Detach a surface from the display: its memory is only unmapped once
+   Python is done with it
+ */
+static void
+pysaver_surface_release(DisplayObject * self, SurfaceObject * s)
+{
+  if (s->image) {
+    XShmDetach(self->dpy, &s->shminfo);
+    s->image->data = NULL;
+    XDestroyImage(s->image);
+    s->image = NULL;
   }
-  
-  if (!(name = pysaver_display_name_low(name))) return NULL;
+}
 
-  if (!(dpy = XOpenDisplay(name))) {
-    PyErr_SetString(PyExc_RuntimeError, "could not connect to display");
-    return NULL;
+/* Drop the fade pending on a pane, if any (see pysaver_fade())
+ */
+static void
+pysaver_fade_cancel(DisplayObject * self, int i)
+{
+  if (self->pfades[i].src) {
+    PyMem_Free(self->pfades[i].src);
+    self->pfades[i].src = NULL;
+    --self->nfading;
   }
+}
 
-  /* Set the error handlers */
-  xstatus = 0;
-  xhdlr = XSetErrorHandler(pysaver_error);
-  
-  /* Allocates structures */
-  nroots = ScreenCount(dpy);
-
-  if (!(roots      = PyMem_New(Window, nroots)) || 
-      !(panes      = PyMem_New(Window, nroots)) ||
-      !(gc         = PyMem_New(GC, nroots)) ||
-      !(pcursors   = PyMem_New(Cursor, nroots)) ||
-      !(pstates    = PyMem_New(int, nroots)) ||
-      !(pcallbacks = PyMem_New(PyObject*, nroots)) ||
-      !(pkeywords  = PyMem_New(PyObject*, nroots)) ||
-      !(pxy        = PyMem_New(int, nroots*2))) {
-    pysaver_xcleanup();
-    PyErr_SetString(PyExc_RuntimeError, "memory allocation problem");
-    return NULL;
+/* Forget the hack windows of a pane, destroying them if asked to: they
+   go along with the pane otherwise, and so do their damage objects
+ */
+static void
+pysaver_slots_clear(DisplayObject * self, int i, int destroy)
+{
+  if (destroy) {
+    if (self->pstandby[i])
+      XDestroyWindow(self->dpy, self->pstandby[i]);
+    if (self->pshown[i])
+      XDestroyWindow(self->dpy, self->pshown[i]);
   }
+  self->pshown[i] = self->pstandby[i] = self->pdamage[i] = None;
+  self->pready[i] = self->pframes[i] = 0;
+}
 
-  /* Create the panes */
-  memset((void*)pstates, 0, sizeof(int)*nroots);
-  memset((void*)pcallbacks, 0, sizeof(PyObject*)*nroots);
-  memset((void*)pkeywords, 0, sizeof(PyObject*)*nroots);
-  memset((void*)pxy, 0, sizeof(int)*2*nroots);
-  attrs.event_mask = EVENT_MASK;
-  memset((void*)&hints, 0, sizeof(MotifWmHints));
-  hints.flags = MWM_HINTS_DECORATIONS;
-  hints.decorations = 0;
-  hintsAtom = XInternAtom (dpy, "_MOTIF_WM_HINTS", False);
-  
-  for(i=0; i<nroots && !xstatus; ++i) {
-    roots[i] = RootWindow(dpy, i);
-    mydebug("Screen %d: %dx%d\n", 
-	    i,
-	    WidthOfScreen(ScreenOfDisplay(dpy, i)),
-	    HeightOfScreen(ScreenOfDisplay(dpy, i)));
+/* Free the X resources of a pane, or what was created of them
+ */
+static void
+pysaver_pane_destroy(DisplayObject * self, int i)
+{
+  pysaver_slots_clear(self, i, 0);
+  if (self->gc[i])
+    XFreeGC(self->dpy, self->gc[i]);
+  if (self->pcursors[i])
+    XFreeCursor(self->dpy, self->pcursors[i]);
+  if (self->panes[i])
+    XDestroyWindow(self->dpy, self->panes[i]);
+  self->gc[i] = NULL;
+  self->pcursors[i] = self->panes[i] = None;
+}
+
+/* Free the X resources of all panes, surfaces included
+ */
+static void
+pysaver_panes_destroy(DisplayObject * self)
+{
+  int i;
+
+  for(i=0;i<self->nroots;++i) {
+    if (self->psurfaces[i])
+      pysaver_surface_release(self, self->psurfaces[i]);
+    pysaver_pane_destroy(self, i);
+  }
+}
+
+/* Resolve the visual and depth of every pane, following the layout:
+   this is all client side, but for the window manager hints atom.
+ */
+static int
+pysaver_panes_prepare(DisplayObject * self)
+{
+  int i, n;
+  unsigned int d = 0;
+  PyObject * val, * item;
+  PaneLayout * l;
+  Screen * s;
+  XVisualInfo vinfo, * pinfo;
+  Visual * vis;
+
+  self->forced = 0;
+  for(i=0; i<self->nroots; ++i) {
+    l = &self->playout[i];
+    s = ScreenOfDisplay(self->dpy, l->screen);
+    self->roots[i] = RootWindow(self->dpy, l->screen);
+
+    /* Visuals are given per screen */
+    vis = NULL;
+    if (self->pvisuals) {
+      if (!(val = PyInt_FromLong(l->screen)))
+	return 0;
+      item = PyDict_GetItem(self->pvisuals, val);
+      Py_DECREF(val);
+      if (item) {
+	if (!PyInt_Check(item)) {
+	  PyErr_SetString(PyExc_RuntimeError, 
+			  "Some specified visual ID not integer");
+	  return 0;
+	}
+	vinfo.visualid = PyInt_AsLong(item);
+	vinfo.screen = l->screen;
+	if ((pinfo = XGetVisualInfo(self->dpy, VisualIDMask | VisualScreenMask, 
+				    &vinfo, &n))) {
+	  vis = pinfo[0].visual;
+	  d = pinfo[0].depth;
+	  XFree(pinfo);
+	  self->forced = 1;
+	} else {
+	  PyErr_SetString(PyExc_RuntimeError, 
+			  "Could not find visual matching visual ID");
+	  return 0;
+	}
+      }
+    }
 
-    s=ScreenOfDisplay(dpy, i);
+    mydebug("Default visual ID on screen %d: 0x%x\n", 
+	    l->screen, 
+	    (unsigned int)XVisualIDFromVisual(DefaultVisualOfScreen(s)));
+
+    l->visual = (vis)?vis:DefaultVisualOfScreen(s);
+    l->depth = (vis)?d:DefaultDepthOfScreen(s);
+  }
+
+  if (self->hints_atom == None)
+    self->hints_atom = XInternAtom(self->dpy, "_MOTIF_WM_HINTS", False);
+  if (!pysaver_table_build(self)) {
+    PyErr_SetString(PyExc_RuntimeError, "memory allocation problem");
+    return 0;
+  }
+  return 1;
+}
+
+/* Create the panes from `first' to `last' excluded, with their GCs and
+   empty cursors: all the requests are pipelined, then checked with a
+   single round trip whatever the number of panes. On error, everything
+   created so far is destroyed and the Python exception is set.
+ */
+static int
+pysaver_panes_create(DisplayObject * self, int first, int last)
+{
+  static const char * problems[] = {
+    "Window creation problem", "GC initialization problem", 
+    "Cursor creation problem" };
+  int i, n;
+  unsigned long failed, * cookies;
+  const char * problem = NULL;
+  PaneLayout * l;
+  Screen * s;
+  XColor black;
+  XGCValues values;
+  XSetWindowAttributes attrs;
+  MotifWmHints hints;
+  Pixmap bit;
+
+  /* Three cookies per pane, for its window, GC and cursor: the ones
+     never issued are left past any serial */
+  n = last - first;
+  if (!(cookies = PyMem_New(unsigned long, 3*n))) {
+    PyErr_SetString(PyExc_RuntimeError, "memory allocation problem");
+    return 0;
+  }
+  memset((void*)cookies, 0xff, sizeof(unsigned long)*3*n);
+
+  attrs.event_mask = EVENT_MASK;
+  memset((void*)&hints, 0, sizeof(MotifWmHints));
+  hints.flags = MWM_HINTS_DECORATIONS;
+  hints.decorations = 0;
+  memset((void*)&black, 0, sizeof(XColor));
+
+  pysaver_check_begin(self);
+  for(i=first; i<last; ++i) {
+    l = &self->playout[i];
+    s = ScreenOfDisplay(self->dpy, l->screen);
+
+    cookies[3*(i-first)] = NextRequest(self->dpy);
+    self->panes[i] = XCreateWindow(self->dpy, self->roots[i], 
+				   l->geom.x, l->geom.y, 
+				   l->geom.width, l->geom.height,
+				   0, l->depth, InputOutput, l->visual,
+				   CWEventMask, &attrs);
+    XChangeProperty(self->dpy, self->panes[i], 
+		    self->hints_atom, self->hints_atom,
+		    32, PropModeReplace,(unsigned char *) &hints,
+		    sizeof (MotifWmHints) / sizeof (long));
+    mydebug("Pane %d (%s): 0x%x\n", i, l->name, (unsigned int)self->panes[i]);
+
+    /* Black is always there: no need to allocate it */
+    cookies[3*(i-first)+1] = NextRequest(self->dpy);
+    values.foreground = BlackPixelOfScreen(s);
+    if (!(self->gc[i] = XCreateGC(self->dpy, self->panes[i], 
+				  GCForeground, &values)))
+      break;
+
+    cookies[3*(i-first)+2] = NextRequest(self->dpy);
+    bit = XCreatePixmapFromBitmapData(self->dpy, self->panes[i], "\000", 
+				      1, 1, BlackPixelOfScreen(s),
+				      BlackPixelOfScreen(s), 1);
+    self->pcursors[i] = XCreatePixmapCursor(self->dpy, bit, bit, 
+					    &black, &black, 0, 0);
+    XDefineCursor(self->dpy, self->panes[i], self->pcursors[i]);
+    XFreePixmap(self->dpy, bit);
+    self->pidle[i] = pysaver_now();
+  }
+  failed = pysaver_check_end(self);
+
+  if (failed) {
+    for (i = 3*n - 1; i > 0 && cookies[i] > failed; --i);
+    problem = (i%3 == 0 && self->forced)?
+      "Window creation problem: check visual":problems[i%3];
+  } else if (i < last)
+    problem = "memory allocation problem";
+  PyMem_Free(cookies);
+
+  /* Cleanup on error: freeing what failed to be created is harmless */
+  if (problem) {
+    for (i=first; i<last; ++i)
+      pysaver_pane_destroy(self, i);
+    PyErr_SetString(PyExc_RuntimeError, problem);
+    return 0;
+  }
+  pysaver_table_build(self);
+  return 1;
+}
+
+/* Release the panes left unactivated for too long, with their surfaces:
+   they will be created anew on activation (see pysaver_activate())
+ */
+static void
+pysaver_panes_release(DisplayObject * self, double now)
+{
+  int i, released = 0;
+
+  for (i=0; i<self->nroots; ++i)
+    if (self->panes[i] && !self->pstates[i] && !self->pfades[i].src &&
+	now - self->pidle[i] >= self->release) {
+      mydebug("Releasing idle pane %d\n", i);
+      if (self->psurfaces[i]) {
+	pysaver_surface_release(self, self->psurfaces[i]);
+	Py_DECREF(self->psurfaces[i]);
+	self->psurfaces[i] = NULL;
+      }
+      pysaver_pane_destroy(self, i);
+      released = 1;
+    }
+  if (released)
+    pysaver_table_build(self);
+}
+
+/*---------------------------------------------------------------------------*/
+static PyObject * 
+pysaver_connect(DisplayObject * self, PyObject * args, PyObject * kw)
+{
+  static char * kwlist[] = {"name", "visuals", "hysteresis", "outputs", 
+			    "record", "release", NULL};
+  int outputs = 0, record = 0;
+  double release = -1.;
+  char * name = NULL;
+  PyObject * visuals = NULL;
+  Display * dpy;
+#ifdef HAVE_XRANDR
+  int i;
+#endif
+#if defined(HAVE_XRANDR) || defined(HAVE_XDAMAGE)
+  int dummy;
+#endif
+
+  self->hyst = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|sOiiid", kwlist, 
+				   &name, &visuals, &self->hyst, &outputs,
+				   &record, &release))
+    return NULL;
+
+  if (self->hyst<0) {
+    PyErr_SetString(PyExc_RuntimeError, "hysteresis cannot be negative");
+    return NULL;
+  }
+
+  if (visuals) {
+    if (!PyDict_Check(visuals)) {
+      PyErr_SetString(PyExc_RuntimeError, "visuals is not a dictionary");
+      return NULL;
+    }
+  }
+
+  if (self->dpy || self->inuse) {
+    PyErr_SetString(PyExc_RuntimeError, "already connected");
+    return NULL;
+  }
+  
+  if (!(name = pysaver_display_name_low(name))) return NULL;
+
+  PYSAVER_UNLOCKED(self, dpy = XOpenDisplay(name));
+  if (!(self->dpy = dpy)) {
+    PyErr_SetString(PyExc_RuntimeError, "could not connect to display");
+    return NULL;
+  }
+
+  /* Set the error handlers */
+  self->xstatus = 0;
+  self->release = release;
+  pysaver_register(self);
+
+  /* Keep the visuals around, for panes to be rebuilt on layout change */
+  Py_XINCREF(visuals);
+  self->pvisuals = visuals;
+
+#ifdef HAVE_XRANDR
+  /* Per-output panes, following the layout changes */
+  self->randr_event = -1;
+  self->prelayout = 0;
+  if (outputs && XRRQueryExtension(self->dpy, &self->randr_event, &dummy))
+    for (i=0; i<ScreenCount(self->dpy); ++i)
+      XRRSelectInput(self->dpy, RootWindow(self->dpy, i), 
+		     RRScreenChangeNotifyMask);
+  else
+    self->randr_event = -1;
+#endif
+
+  /* Allocates structures, then create the panes */
+  if (!pysaver_layout(self) || !pysaver_panes_alloc(self)) {
+    pysaver_xcleanup(self);
+    PyErr_SetString(PyExc_RuntimeError, "memory allocation problem");
+    return NULL;
+  }
+  if (!pysaver_panes_prepare(self) ||
+      (self->release < 0 && !pysaver_panes_create(self, 0, self->nroots))) {
+    pysaver_xcleanup(self);
+    return NULL;
+  }
+
+  /* Look for the IDLETIME counter: its absence is not an error */
+  pysaver_sync_init(self);
+  self->shm = XShmQueryExtension(self->dpy);
+  self->damage_event = -1;
+#ifdef HAVE_XDAMAGE
+  if (!XDamageQueryExtension(self->dpy, &self->damage_event, &dummy) ||
+      !XDamageQueryVersion(self->dpy, &dummy, &dummy))
+    self->damage_event = -1;
+#endif
+#ifdef HAVE_XRECORD
+  if (record)
+    pysaver_record_init(self);
+#endif
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+/*---------------------------------------------------------------------------*/
+static PyObject *
+pysaver_disconnect(DisplayObject * self, PyObject * args)
+{
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  pysaver_panes_destroy(self);
+  pysaver_xcleanup(self);
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+/*---------------------------------------------------------------------------*/
+static PyObject *
+pysaver_connected(DisplayObject * self, PyObject * args)
+{
+  PyObject * ret = (self->dpy)?Py_True:Py_False;
+  Py_INCREF(ret);
+  return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+static PyObject *
+pysaver_screens(DisplayObject * self, PyObject * args)
+{
+  return (pysaver_checkdpy(self))?Py_BuildValue("i", self->nroots):NULL;
+}
+
+static PyObject *
+pysaver_activated(DisplayObject * self, PyObject * args)
+{
+  int i;
+
+  if (!PyArg_ParseTuple(args, "i", &i)) return NULL;
+  if (!pysaver_checkdpy(self)) return NULL;
+  
+  if (i<0 || i >= self->nroots) {
+    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+    return NULL;
+  }
+  
+  if (self->pstates[i]) 
+    return Py_BuildValue("i", self->panes[i]);
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject *
+pysaver_visible(DisplayObject * self, PyObject * args)
+{
+  int i;
+
+  if (!PyArg_ParseTuple(args, "i", &i)) return NULL;
+  if (!pysaver_checkdpy(self)) return NULL;
+  
+  if (i<0 || i >= self->nroots) {
+    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+    return NULL;
+  }
+  return PyBool_FromLong(self->pstates[i] && self->pvisible[i]);
+}
+
+static int
+pysaver_desactivate_low(DisplayObject * self, int i) 
+{
+  int status = 1;
+  double start;
+  PyObject * r, * a, * cb, * kw;
+
+  /* This test can seems redundant (see calls in pysaver_pool and
+     pysaver_desactivate), but it is not: that's a fine optimization
+     in case of desactivation by callbacks.
+  */
+  if (self->pstates[i]) {
+    mydebug("Unmapping pane %i\n", i);
+    XUnmapWindow(self->dpy, self->panes[i]);
+
+    /* Unblanking is never delayed: a fade in progress is dropped, and
+       the surface will only be shown again once presented anew */
+    pysaver_fade_cancel(self, i);
+    pysaver_slots_clear(self, i, 1);
+    if (self->psurfaces[i])
+      self->psurfaces[i]->presented = 0;
+
+    /* ...And to run the callback, if one is registered: the pane is
+       done with first, since the callback may free all the panes */
+    self->pexposing[i] = 0.;
+    self->pidle[i] = pysaver_now();
+    self->pstates[i] = 0;
+    cb = self->pcallbacks[i];
+    kw = self->pkeywords[i];
+    self->pcallbacks[i] = NULL;
+    self->pkeywords[i] = NULL;
+    if (cb) {
+      start = pysaver_now();
+      if (kw)
+	r = PyEval_CallObjectWithKeywords(cb, a = Py_BuildValue("()"), kw);
+      else
+	r = PyEval_CallObject(cb, a = Py_BuildValue("()"));
+      pysaver_stats_since(self, STATS_CALLBACKS, start);
+      
+      Py_XDECREF(a);
+      Py_XDECREF(r);
+      if (!r) status = 0;
+    }
+    Py_XDECREF(cb);
+    Py_XDECREF(kw);
+  }
+
+  return status && !self->xstatus;
+}
+
+static PyObject *
+pysaver_desactivate(DisplayObject * self, PyObject * args)
+{
+  int i;
+  
+  if (!PyArg_ParseTuple(args, "i", &i)) return NULL;
+   if (!pysaver_checkdpy(self)) return NULL;
+  
+  if (i<0 || i >= self->nroots) {
+    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+    return NULL;
+  }
+
+  if (self->pstates[i]) {
+    if (!pysaver_desactivate_low(self, i))
+      return NULL;
+  }
+#ifdef MYDEBUG
+  else
+    mydebug("Screen %d already desactivated\n", i);
+#endif
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject *
+pysaver_activate(DisplayObject * self, PyObject * args, PyObject * kw)
+{
+  PyObject * cb = NULL;
+  int i; 
+
+  if (!PyArg_ParseTuple(args, "i|O", &i, &cb))
+    return NULL;
+
+  if (!pysaver_checkdpy(self)) return NULL;
+  
+  if (i<0 || i >= self->nroots) {
+    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+    return NULL;
+  }
+
+  if (cb && !PyCallable_Check(cb)) {
+    PyErr_SetString(PyExc_RuntimeError, "callback parameter is not callable");
+    return NULL;
+  }
+  
+  if (!self->pstates[i]) {
+    mydebug("Activating screen %d\n", i);
+    if (!self->panes[i] && !pysaver_panes_create(self, i, i+1))
+      return NULL;
+    XMapWindow(self->dpy, self->panes[i]);
+    XRaiseWindow(self->dpy, self->panes[i]);
+    self->pexposing[i] = pysaver_now();
+    self->pvisible[i] = 1;
+    Py_XINCREF(cb);
+    self->pstates[i] = 1;
+    self->pcallbacks[i] = cb;
+    if (kw) {
+      Py_XINCREF(kw);
+      self->pkeywords[i] = kw;
+    }
+    
+  }
+#ifdef MYDEBUG
+  else 
+    mydebug("Screen %d already activated\n", i);
+#endif
+
+  return Py_BuildValue("i", self->panes[i]);
+}
+
+/*---------------------------------------------------------------------------*/
+/* MIT-SHM surfaces
+ */
+static SurfaceObject *
+pysaver_surface_new(DisplayObject * self, int i)
+{
+  unsigned long failed;
+  SurfaceObject * s;
+  PaneLayout * l = &self->playout[i];
+
+  if (!(s = PyObject_New(SurfaceObject, &SurfaceType)))
+    return NULL;
+  s->shminfo.shmid = -1;
+  s->shminfo.shmaddr = (char *)-1;
+  s->shminfo.readOnly = False;
+  s->presented = 0;
+
+  if (!(s->image = XShmCreateImage(self->dpy, l->visual, l->depth, ZPixmap,
+				   NULL, &s->shminfo, 
+				   l->geom.width, l->geom.height)))
+    goto error;
+  s->size = s->image->bytes_per_line * s->image->height;
+  if ((s->shminfo.shmid = shmget(IPC_PRIVATE, s->size, IPC_CREAT | 0600)) < 0
+      || (s->shminfo.shmaddr = shmat(s->shminfo.shmid, NULL, 0)) == 
+      (char *)-1)
+    goto error;
+  s->image->data = s->shminfo.shmaddr;
+  memset(s->shminfo.shmaddr, 0, s->size);
+
+  /* Once both sides are attached, the segment can be marked for
+     removal: it will go away with its last user */
+  pysaver_check_begin(self);
+  XShmAttach(self->dpy, &s->shminfo);
+  failed = pysaver_check_end(self);
+  shmctl(s->shminfo.shmid, IPC_RMID, NULL);
+  s->shminfo.shmid = -1;
+  if (failed)
+    goto error;
+  mydebug("Surface on pane %d: %dx%d, %d bpp\n", i, 
+	  s->image->width, s->image->height, s->image->bits_per_pixel);
+  return s;
+
+ error:
+  if (s->image) {
+    s->image->data = NULL;
+    XDestroyImage(s->image);
+    s->image = NULL;
+  }
+  if (s->shminfo.shmid >= 0)
+    shmctl(s->shminfo.shmid, IPC_RMID, NULL);
+  Py_DECREF(s);
+  PyErr_SetString(PyExc_RuntimeError, "could not create shared surface");
+  return NULL;
+}
+
+/* Push a rectangle of a pane surface to the screen, clipped to it
+ */
+static void
+pysaver_surface_put(DisplayObject * self, int i, XRectangle * r)
+{
+  int x, y, w, h;
+  XImage * im = self->psurfaces[i]->image;
+
+  if (!self->panes[i])
+    return;
+
+  x = (r->x < 0)?0:r->x;
+  y = (r->y < 0)?0:r->y;
+  w = ((r->x + r->width > im->width)?im->width:r->x + r->width) - x;
+  h = ((r->y + r->height > im->height)?im->height:r->y + r->height) - y;
+  if (w > 0 && h > 0)
+    XShmPutImage(self->dpy, self->panes[i], self->gc[i], im, 
+		 x, y, x, y, w, h, False);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Fades: a pane surface is loaded with what the screen shows, then
+   blended toward black a bit more at each pool() call
+ */
+/* Kept as a plain loop over bytes for the compiler to vectorize it:
+   only used on 24 and 32 bpp images, where each byte is a channel
+ */
+static void
+pysaver_blend(unsigned char * dst, const unsigned char * src, size_t n,
+	      unsigned int alpha)
+{
+  size_t k;
+
+  for (k = 0; k < n; ++k)
+    dst[k] = (unsigned char)((src[k] * alpha) >> 8);
+}
+
+static void
+pysaver_fade_step(DisplayObject * self)
+{
+  int i;
+  double now, elapsed;
+  unsigned int alpha;
+  XRectangle r;
+  PaneFade * f;
+  SurfaceObject * s;
+
+  now = pysaver_now();
+  for (i = 0; i < self->nroots; ++i) {
+    f = &self->pfades[i];
+    if (!f->src || !self->pstates[i])
+      continue;
+    if (f->start == 0.)
+      f->start = now;
+    elapsed = now - f->start;
+    alpha = (elapsed >= f->duration)?0:
+      (unsigned int)(256. * (1. - elapsed / f->duration));
+
+    s = self->psurfaces[i];
+    pysaver_blend((unsigned char *)s->image->data, f->src, s->size, alpha);
+    r.x = r.y = 0;
+    r.width = s->image->width;
+    r.height = s->image->height;
+    pysaver_surface_put(self, i, &r);
+    if (!alpha) {
+      mydebug("Fade done on pane %d\n", i);
+      pysaver_fade_cancel(self, i);
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Gather an event into the batch of its pane: only the latest pointer
+   position is kept, while motions past the hysteresis, key and button
+   presses are remembered for the whole batch, and exposed rectangles
+   are accumulated.
+ */
+static int
+pysaver_batch(DisplayObject * self, XEvent * ev)
+{
+  int i;
+  PaneBatch * b;
+  XRectangle * rects;
+  XSyncAlarm * alarms;
+
+  /* Alarms are not related to any pane */
+  if (self->idle_counter != None && 
+      ev->type == self->sync_event + XSyncAlarmNotify) {
+    if (self->nfired == self->maxfired) {
+      if (!(alarms = PyMem_Resize(self->fired, XSyncAlarm, 
+				  self->maxfired?self->maxfired*2:8))) {
+	PyErr_SetString(PyExc_RuntimeError, "memory allocation problem");
+	return 0;
+      }
+      self->fired = alarms;
+      self->maxfired = self->maxfired?self->maxfired*2:8;
+    }
+    self->fired[self->nfired++] = ((XSyncAlarmNotifyEvent *)ev)->alarm;
+    return 1;
+  }
+
+#ifdef HAVE_XDAMAGE
+  /* Standby windows are ready as soon as they got drawn upon: damage
+     is then repaired, for the next frame to be reported as well */
+  if (self->damage_event >= 0 && 
+      ev->type == self->damage_event + XDamageNotify) {
+    for (i=0; i<self->nroots; ++i)
+      if (self->pdamage[i] && 
+	  self->pdamage[i] == ((XDamageNotifyEvent *)ev)->damage) {
+	XDamageSubtract(self->dpy, self->pdamage[i], None, None);
+	self->pready[i] = 1;
+	++self->pframes[i];
+      }
+    return 1;
+  }
+#endif
+
+#ifdef HAVE_XRANDR
+  /* Layout changes are only flagged here: see relayout() */
+  if (self->randr_event >= 0 && 
+      ev->type == self->randr_event + RRScreenChangeNotify) {
+    XRRUpdateConfiguration(ev);
+    self->prelayout = 1;
+    return 1;
+  }
+#endif
+
+  /* Identify the pane, discarding events on unknown or now unmapped ones */
+  if ((i = pysaver_pane(self, ev->xany.window)) < 0 || !self->pstates[i])
+    return 1;
+
+  /* Visibility calls for no reaction here: see visible() */
+  if (ev->type == VisibilityNotify) {
+    self->pvisible[i] = ev->xvisibility.state != VisibilityFullyObscured;
+    return 1;
+  }
+
+  b = &self->pbatch[i];
+  if (!b->touched) {
+    b->touched = 1;
+    b->moved = b->hit = b->nrects = 0;
+    self->ptouched[self->ntouched++] = i;
+  }
+
+  switch(ev->type) {
+  case Expose:
+    if (self->pexposing[i] != 0.) {
+      pysaver_stats_since(self, STATS_EXPOSE, self->pexposing[i]);
+      self->pexposing[i] = 0.;
+    }
+    if (b->nrects == b->maxrects) {
+      if (!(rects = PyMem_Resize(b->rects, XRectangle, 
+				 b->maxrects?b->maxrects*2:8))) {
+	PyErr_SetString(PyExc_RuntimeError, "memory allocation problem");
+	return 0;
+      }
+      b->rects = rects;
+      b->maxrects = b->maxrects?b->maxrects*2:8;
+    }
+    b->rects[b->nrects].x = ev->xexpose.x;
+    b->rects[b->nrects].y = ev->xexpose.y;
+    b->rects[b->nrects].width = ev->xexpose.width;
+    b->rects[b->nrects].height = ev->xexpose.height;
+    ++b->nrects;
+    break;
+  case MotionNotify:
+    b->x = ev->xmotion.x_root;
+    b->y = ev->xmotion.y_root;
+    if ((abs(b->x-self->pxy[2*i]) > self->hyst) || 
+	(abs(b->y-self->pxy[2*i+1]) > self->hyst))
+      b->moved = 1;
+    break;
+  case ButtonPress:
+  case KeyPress:
+  case KeyRelease:
+    b->hit = 1;
+    break;
+  default:
+    mydebug("Ouch! Unhandled event: looks like there is a bug looming...\n");
+  }
+  return 1;
+}
+
+static void
+pysaver_batch_clear(DisplayObject * self, int from)
+{
+  for (; from < self->ntouched; ++from)
+    self->pbatch[self->ptouched[from]].touched = 0;
+  self->ntouched = 0;
+}
+
+/* Query the pointer and the keyboard: this does not touch any Python
+   object, so that it can run without the interpreter lock
+ */
+static int
+pysaver_query(DisplayObject * self, int * x, int * y, int * keyboard)
+{
+  char keys[32];
+  int i, j, screen, ok, found = 0;
+  Window dummy;
+  PaneLayout * l;
+
+  /* Query the pointer, once per screen, and find the pane it is on */
+  for (i=0, screen=-1; i<self->nroots; ++i) {
+    l = &self->playout[i];
+    if (l->screen != screen) {
+      screen = l->screen;
+      PYSAVER_TIMED(self, STATS_POINTER,
+		    found = XQueryPointer(self->dpy, self->roots[i], 
+					  &dummy, &dummy, 
+					  x, y, 
+					  &j, &j, (unsigned int*)&j) == True);
+    }
+    if (found && 
+	*x >= l->geom.x && *x < l->geom.x + l->geom.width &&
+	*y >= l->geom.y && *y < l->geom.y + l->geom.height)
+      break;
+  }
+
+  /* Query the keyboard */
+  *keyboard = 0;
+  PYSAVER_TIMED(self, STATS_KEYMAP, ok = XQueryKeymap(self->dpy, keys));
+  if (ok == True)
+    for(j=0; j<32 && !*keyboard; ++j)
+      *keyboard = keys[j] != 0;
+
+  return i;
+}
+
+static PyObject *
+pysaver_pool(DisplayObject * self, PyObject * args)
+{
+  int i, j, n, x, y, keyboard, hit = -1;
+  unsigned long layouts;
+  XEvent ev;
+  PaneBatch * b;
+  
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  /* Drain everything queued so far in one batch, gathering it per pane */
+  self->xstatus = 0;
+  PYSAVER_UNLOCKED(self, n = XEventsQueued(self->dpy, QueuedAfterReading));
+  pysaver_stats_add(self, STATS_EVENTS, n);
+  for (; n > 0 && !self->xstatus; --n) {
+    XNextEvent(self->dpy, &ev);
+    if (!pysaver_batch(self, &ev)) {
+      pysaver_batch_clear(self, 0);
+      return NULL;
+    }
+  }
+
+#ifdef HAVE_XRECORD
+  /* Collect the recorded input received so far, without waiting */
+  if (self->rdpy)
+    PYSAVER_UNLOCKED(self, 
+		     XEventsQueued(self->rdpy, QueuedAfterReading);
+		     XRecordProcessReplies(self->rdpy));
+#endif
+
+  /* Then act once per pane */
+  layouts = self->playouts;
+  for (j = 0; j < self->ntouched; ++j) {
+    b = &self->pbatch[i = self->ptouched[j]];
+    b->touched = 0;
+    if (!self->pstates[i])
+      continue;
+    if (b->hit)
+      hit = i;
+    if (b->moved || b->hit) {
+      mydebug("Activity on pane %d (%s)\n", i, (b->hit)?"hit":"motion");
+      /* Time to perform the unmapping... Bail out in case of error,
+	 or as soon as a callback freed the panes, the batch with them */
+      if (!pysaver_desactivate_low(self, i)) {
+	if (self->playouts == layouts)
+	  pysaver_batch_clear(self, j + 1);
+	return NULL;
+      }
+      if (self->playouts != layouts) {
+	hit = -1;
+	break;
+      }
+    } else if (b->nrects && self->psurfaces[i] && 
+	       self->psurfaces[i]->presented) {
+      for (n = 0; n < b->nrects; ++n)
+	pysaver_surface_put(self, i, &b->rects[n]);
+    } else if (b->nrects) {
+      XFillRectangles(self->dpy, self->panes[i], self->gc[i], 
+		      b->rects, b->nrects);
+      mydebug("Expose, pane %d (%d rectangles)\n", i, b->nrects);
+    }
+  }
+  self->ntouched = 0;
+
+  /* Callbacks may have disconnected us */
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  /* The query below is a round trip: the server will be done reading
+     the surfaces by the time next step blends them again */
+  if (self->nfading)
+    pysaver_fade_step(self);
+  if (self->release >= 0)
+    pysaver_panes_release(self, pysaver_now());
+  PYSAVER_UNLOCKED(self, i = pysaver_query(self, &x, &y, &keyboard));
+
+  if (self->xstatus) {
+    PyErr_SetString(PyExc_RuntimeError, "An X protocol error occured");
+    return NULL;
+  }
+
+  /* Keys and buttons pressed on panes during the batch count as much as
+     the keyboard state now, even if the pointer went elsewhere since */
+  if (i<self->nroots) {
+    if (!self->pstates[i]) {
+      self->pxy[i*2]   = x;
+      self->pxy[i*2+1] = y;
+    }
+    return Py_BuildValue("(i, ((i, i), O))", 
+			 i, x, y, (keyboard || hit >= 0)?Py_True:Py_False);
+  } else if (hit >= 0)
+    return Py_BuildValue("(i, ((i, i), O))", hit,
+			 self->pxy[hit*2], self->pxy[hit*2+1], Py_True);
+  else
+    return Py_BuildValue("(O, ((i, i), O))", Py_None, 0, 0, Py_False);
+}
+
+/*---------------------------------------------------------------------------*/
+static PyObject *
+pysaver_geometry(DisplayObject * self, PyObject * args)
+{
+  int i;
+  PaneLayout * l;
+
+  if (!PyArg_ParseTuple(args, "i", &i)) return NULL;
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  if (i<0 || i >= self->nroots) {
+    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+    return NULL;
+  }
+
+  l = &self->playout[i];
+  return Py_BuildValue("(i, (i, i, i, i), z)", l->screen,
+		       l->geom.x, l->geom.y, l->geom.width, l->geom.height,
+		       (l->name[0])?l->name:NULL);
+}
+
+static PyObject *
+pysaver_layout_changed(DisplayObject * self, PyObject * args)
+{
+  PyObject * ret = Py_False;
+
+  if (!pysaver_checkdpy(self)) return NULL;
+#ifdef HAVE_XRANDR
+  if (self->prelayout) ret = Py_True;
+#endif
+  Py_INCREF(ret);
+  return ret;
+}
+
+static PyObject *
+pysaver_relayout(DisplayObject * self, PyObject * args)
+{
+  int i, status = 1;
+  unsigned long layouts;
+
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  /* Desactivate everything, callbacks included, before rebuilding:
+     should a callback disconnect or relayout itself, it is all done */
+  layouts = self->playouts;
+  for (i=0; i<self->nroots; ++i) {
+    if (self->pstates[i] && !pysaver_desactivate_low(self, i))
+      status = 0;
+    if (self->playouts != layouts) {
+      if (status && !pysaver_checkdpy(self)) return NULL;
+      return (status)?Py_BuildValue("i", self->nroots):NULL;
+    }
+  }
+  pysaver_panes_destroy(self);
+  pysaver_panes_free(self);
+#ifdef HAVE_XRANDR
+  self->prelayout = 0;
+#endif
+
+  if (!pysaver_layout(self) || !pysaver_panes_alloc(self)) {
+    PyErr_SetString(PyExc_RuntimeError, "memory allocation problem");
+    goto error;
+  }
+  if (!pysaver_panes_prepare(self) ||
+      (self->release < 0 && !pysaver_panes_create(self, 0, self->nroots)))
+    goto error;
+  return (status)?Py_BuildValue("i", self->nroots):NULL;
+
+ error:
+  /* Without panes, the connection is of no use: it goes with them, for
+     every later call to fail cleanly */
+  pysaver_xcleanup(self);
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static PyObject *
+pysaver_dpms(DisplayObject * self, PyObject * args)
+{
+  static char * levels[] = { "on", "standby", "suspend", "off" };
+  char * level = NULL;
+  int i, dummy;
+  CARD16 power;
+  BOOL state;
+  Status ok;
+
+  if (!PyArg_ParseTuple(args, "|s", &level)) return NULL;
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  if (!DPMSQueryExtension(self->dpy, &dummy, &dummy) || 
+      !DPMSCapable(self->dpy)) {
+    PyErr_SetString(PyExc_RuntimeError, "DPMS unavailable");
+    return NULL;
+  }
+
+  if (level) {
+    for (i=0; i<4 && strcmp(level, levels[i]); ++i);
+    if (i == 4) {
+      PyErr_SetString(PyExc_RuntimeError, "unknown power level");
+      return NULL;
+    }
+
+    /* Forcing a level requires DPMS to be enabled: we do it as needed,
+       and restore it when powering back on */
+    PYSAVER_TIMED(self, STATS_DPMS, ok = DPMSInfo(self->dpy, &power, &state));
+    if (!ok) state = False;
+    if (!state && i != DPMSModeOn) {
+      DPMSEnable(self->dpy);
+      self->dpms_enabled = 1;
+    }
+    self->xstatus = 0;
+    DPMSForceLevel(self->dpy, (CARD16)i);
+    if (self->dpms_enabled && i == DPMSModeOn) {
+      DPMSDisable(self->dpy);
+      self->dpms_enabled = 0;
+    }
+  }
+
+  PYSAVER_ROUNDTRIP(self, STATS_DPMS, 
+		    ok = DPMSInfo(self->dpy, &power, &state));
+  if (!ok || self->xstatus) {
+    PyErr_SetString(PyExc_RuntimeError, "could not set or query DPMS");
+    return NULL;
+  }
+  return Py_BuildValue("(s, O)", (power < 4)?levels[power]:"on",
+		       (state)?Py_True:Py_False);
+}
+
+/*---------------------------------------------------------------------------*/
+static PyObject *
+pysaver_surface(DisplayObject * self, PyObject * args)
+{
+  int i;
+  SurfaceObject * s;
+
+  if (!PyArg_ParseTuple(args, "i", &i)) return NULL;
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  if (i<0 || i >= self->nroots) {
+    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+    return NULL;
+  }
+
+  if (!(s = self->psurfaces[i])) {
+    if (!self->shm) {
+      PyErr_SetString(PyExc_RuntimeError, "MIT-SHM unavailable");
+      return NULL;
+    }
+    if (!(s = self->psurfaces[i] = pysaver_surface_new(self, i)))
+      return NULL;
+  }
+
+  return Py_BuildValue("(N, i, i, i, i)", 
+		       PyMemoryView_FromObject((PyObject *)s),
+		       s->image->width, s->image->height,
+		       s->image->bytes_per_line, s->image->bits_per_pixel);
+}
+
+static PyObject *
+pysaver_present(DisplayObject * self, PyObject * args)
+{
+  int i, j, n;
+  PyObject * rects = Py_None, * seq;
+  XRectangle r;
+
+  if (!PyArg_ParseTuple(args, "i|O", &i, &rects)) return NULL;
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  if (i<0 || i >= self->nroots) {
+    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+    return NULL;
+  }
+  if (!self->psurfaces[i]) {
+    PyErr_SetString(PyExc_RuntimeError, "no surface on this screen");
+    return NULL;
+  }
 
-    vis = NULL;
-    if (visuals) {
-      if ((item = PyDict_GetItem(visuals, (val = PyInt_FromLong(i))))) {
-	if (!PyInt_Check(item)) {
-	  Py_DECREF(item);
-	  PyErr_SetString(PyExc_RuntimeError, 
-			  "Some specified visual ID not integer");
-	  xstatus = 1; --i;
-	  continue;
-	}
-	Py_DECREF(item);
-	vinfo.visualid = PyInt_AsLong(item);
-	if ((pinfo = XGetVisualInfo(dpy, VisualIDMask, &vinfo, &n))) {
-	  vis = pinfo[0].visual;
-	  d = pinfo[0].depth;
-	  XFree(pinfo);
-	} else {
-	  Py_DECREF(item);
-	  PyErr_SetString(PyExc_RuntimeError, 
-			  "Could not find visual matching visual ID");
-	  
-	  xstatus = 1; --i;
-	  continue;
-	}
+  self->xstatus = 0;
+  if (rects == Py_None) {
+    r.x = r.y = 0;
+    r.width = self->playout[i].geom.width;
+    r.height = self->playout[i].geom.height;
+    pysaver_surface_put(self, i, &r);
+  } else {
+    if (!(seq = PySequence_Fast(rects, "rectangles is not a sequence")))
+      return NULL;
+    for (j = 0, n = PySequence_Fast_GET_SIZE(seq); j < n; ++j) {
+      if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, j), "hhHH", 
+			    &r.x, &r.y, &r.width, &r.height)) {
+	Py_DECREF(seq);
+	return NULL;
       }
-      Py_XDECREF(val);
+      pysaver_surface_put(self, i, &r);
     }
-
-    mydebug("Default visual ID on screen %d: 0x%x\n", 
-	    i, (unsigned int)XVisualIDFromVisual(DefaultVisualOfScreen(s)));
-
-    panes[i] = XCreateWindow(dpy, roots[i], 
-			     0, 0, 
-			     WidthOfScreen(s),
-			     HeightOfScreen(s),
-			     0, 
-			     (vis)?d:DefaultDepthOfScreen(s), 
-			     InputOutput, 
-			     (vis)?vis:DefaultVisualOfScreen(s),
-			     CWEventMask, &attrs);
-
-    XChangeProperty(dpy, panes[i], hintsAtom, hintsAtom,
-		    32, PropModeReplace,(unsigned char *) &hints,
-		    sizeof (MotifWmHints) / sizeof (long));
-    mydebug("Pane %d: 0x%x\n", i, (unsigned int)panes[i]);
-    XSync(dpy, False);
+    Py_DECREF(seq);
   }
+  self->psurfaces[i]->presented = 1;
+  XFlush(self->dpy);
 
-  /* Cleanup on panes creation error */
-  XSync(dpy, False);
-  if (xstatus) {
-    for (--i; i>=0; --i)
-      XDestroyWindow(dpy, panes[i]);
-    pysaver_xcleanup();
-    if (!PyErr_Occurred())
-      PyErr_SetString(PyExc_RuntimeError, 
-		      (vis)?"Window creation problem: check visual":
-		      "Window creation problem");
+  if (self->xstatus) {
+    PyErr_SetString(PyExc_RuntimeError, "An X protocol error occured");
     return NULL;
   }
+  Py_INCREF(Py_None);
+  return Py_None;
+}
 
-  /* Create the GCs, one per pane */
-  for(i=0; i<nroots && !xstatus; ++i) {
-    if ((XAllocNamedColor(dpy, DefaultColormap(dpy, i), 
-			  "rgb:00/00/00", &col1, &col2) == 0) &&
-	(XAllocColor(dpy, DefaultColormap(dpy, i), &col1) == 0)) {
-      
-      PyErr_SetString(PyExc_RuntimeError, "X color allocation problem");
-      xstatus = 1;
-    } else {
-      gc[i] = XCreateGC(dpy, panes[i], 0, NULL);
-      XSetForeground(dpy, gc[i], col1.pixel);
-      mydebug("gc %d, 0x%x\n", i, (unsigned int)gc[i]);
+static PyObject *
+pysaver_fade(DisplayObject * self, PyObject * args)
+{
+  int i;
+  double duration;
+  unsigned char * src;
+  PaneLayout * l;
+  SurfaceObject * s;
 
-      if (xstatus) 
-	PyErr_SetString(PyExc_RuntimeError, "GC initialization problem");
-    }
-    XSync(dpy, False);
+  if (!PyArg_ParseTuple(args, "id", &i, &duration)) return NULL;
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  if (i<0 || i >= self->nroots) {
+    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+    return NULL;
   }
-  
-  /* Cleanup on color allocation or gc problem */
-  if (xstatus) {
-    for (--i; i>=0; --i) 
-      XFreeGC(dpy, gc[i]);
-    for (i=0; i<nroots; ++i)
-      XDestroyWindow(dpy, panes[i]);
-    pysaver_xcleanup();
+  if (self->pstates[i]) {
+    PyErr_SetString(PyExc_RuntimeError, "screen already activated");
+    return NULL;
+  }
+  if (!self->shm) {
+    PyErr_SetString(PyExc_RuntimeError, "MIT-SHM unavailable");
     return NULL;
   }
 
-  /* Create the empty cursors, one per pane */
-  for(i=0; i<nroots && !xstatus; ++i) {
-    if ((bit = XCreatePixmapFromBitmapData(dpy, panes[i],
-	         "\000", 1, 1,
-		 BlackPixelOfScreen(ScreenOfDisplay(dpy, i)),
-		 BlackPixelOfScreen(ScreenOfDisplay(dpy, i)),
-		 1))) {
-      pcursors[i] = XCreatePixmapCursor(dpy, bit, bit, 
-					&col1, &col1,
-					0, 0);
-      XDefineCursor(dpy, panes[i], pcursors[i]);
-      XFreePixmap(dpy, bit);
-    } else {
-      PyErr_SetString(PyExc_RuntimeError, "Cursor pixmap creation problem");
-      xstatus = 1;
-    }
-    XSync(dpy, False);
+  /* The screen content is read straight into the surface: both need
+     to share the same pixel format */
+  l = &self->playout[i];
+  if (l->visual != DefaultVisual(self->dpy, l->screen) ||
+      l->depth != DefaultDepth(self->dpy, l->screen)) {
+    PyErr_SetString(PyExc_RuntimeError, "fades need the default visual");
+    return NULL;
+  }
+  if (!(s = self->psurfaces[i]) && 
+      !(s = self->psurfaces[i] = pysaver_surface_new(self, i)))
+    return NULL;
+  if (s->image->bits_per_pixel != 24 && s->image->bits_per_pixel != 32) {
+    PyErr_SetString(PyExc_RuntimeError, "fades need 24 or 32 bpp");
+    return NULL;
   }
 
-  /* Cleanup on cursor creation problem */
-  XSync(dpy, False);
-  if (xstatus) {
-    for (--i; i>=0; --i) 
-      XFreeCursor(dpy, pcursors[i]);
-    for (i=0; i<nroots; ++i) {
-      XDestroyWindow(dpy, panes[i]);
-      XFreeGC(dpy, gc[i]);
-    }
+  pysaver_fade_cancel(self, i);
+  if (!(src = PyMem_Malloc(s->size)))
+    return PyErr_NoMemory();
+  self->xstatus = 0;
+  PYSAVER_ROUNDTRIP(self, STATS_IMAGE,
+		    XShmGetImage(self->dpy, self->roots[i], s->image,
+				 l->geom.x, l->geom.y, AllPlanes));
+  if (self->xstatus) {
+    PyMem_Free(src);
+    PyErr_SetString(PyExc_RuntimeError, "An X protocol error occured");
     return NULL;
   }
+  memcpy(src, s->image->data, s->size);
+
+  self->pfades[i].src = src;
+  self->pfades[i].start = 0.;
+  self->pfades[i].duration = duration;
+  ++self->nfading;
+  s->presented = 1;
 
   Py_INCREF(Py_None);
   return Py_None;
 }
 
+static PyObject *
+pysaver_fading(DisplayObject * self, PyObject * args)
+{
+  if (!pysaver_checkdpy(self)) return NULL;
+  return PyBool_FromLong(self->nfading > 0);
+}
+
 /*---------------------------------------------------------------------------*/
+/* Hack windows, for seamless cycling
+ */
+static int
+pysaver_checkslots(DisplayObject * self, int i)
+{
+  if (!pysaver_checkdpy(self)) return 0;
+  if (i<0 || i >= self->nroots) {
+    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+    return 0;
+  }
+  if (!self->pstates[i]) {
+    PyErr_SetString(PyExc_RuntimeError, "screen not activated");
+    return 0;
+  }
+  return 1;
+}
+
 static PyObject *
-pysaver_disconnect(PyObject * self, PyObject * args)
+pysaver_standby(DisplayObject * self, PyObject * args)
 {
   int i;
+  Window w;
+  unsigned long failed;
+  PaneLayout * l;
 
-  if (!pysaver_checkdpy()) return NULL;
-
-  for(i=0;i<nroots;++i) {
-    XFreeGC(dpy, gc[i]);
-    XFreeCursor(dpy, pcursors[i]);
-    XDestroyWindow(dpy, panes[i]);
+  if (!PyArg_ParseTuple(args, "i", &i)) return NULL;
+  if (!pysaver_checkslots(self, i)) return NULL;
+
+  if (!self->pstandby[i]) {
+    /* Mapped below the window the pane shows, if any: it stays out of
+       sight behind it (drawing into the pane itself would not) */
+    l = &self->playout[i];
+    pysaver_check_begin(self);
+    w = XCreateWindow(self->dpy, self->panes[i], 0, 0, 
+		      l->geom.width, l->geom.height, 0, CopyFromParent, 
+		      InputOutput, CopyFromParent, 0, NULL);
+    XLowerWindow(self->dpy, w);
+    XMapWindow(self->dpy, w);
+#ifdef HAVE_XDAMAGE
+    if (self->damage_event >= 0)
+      self->pdamage[i] = XDamageCreate(self->dpy, w, 
+				       XDamageReportNonEmpty);
+#endif
+    if ((failed = pysaver_check_end(self))) {
+      XDestroyWindow(self->dpy, w);
+      self->pdamage[i] = None;
+      PyErr_SetString(PyExc_RuntimeError, "Window creation problem");
+      return NULL;
+    }
+    self->pstandby[i] = w;
+    self->pready[i] = self->pframes[i] = 0;
   }
-  
-  pysaver_xcleanup();
-  Py_INCREF(Py_None);
-  return Py_None;
+  return Py_BuildValue("i", self->pstandby[i]);
 }
 
-/*---------------------------------------------------------------------------*/
 static PyObject *
-pysaver_connected(PyObject * self, PyObject * args)
+pysaver_standby_ready(DisplayObject * self, PyObject * args)
 {
-  PyObject * ret = (dpy)?Py_True:Py_False;
-  Py_INCREF(ret);
-  return ret;
+  int i;
+
+  if (!PyArg_ParseTuple(args, "i", &i)) return NULL;
+  if (!pysaver_checkslots(self, i)) return NULL;
+
+  if (!self->pstandby[i]) {
+    PyErr_SetString(PyExc_RuntimeError, "no standby window on this screen");
+    return NULL;
+  }
+  if (self->damage_event < 0) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  return PyBool_FromLong(self->pready[i]);
 }
 
-/*---------------------------------------------------------------------------*/
 static PyObject *
-pysaver_screens(PyObject * self, PyObject * args)
+pysaver_frames(DisplayObject * self, PyObject * args)
 {
-  return (pysaver_checkdpy())?Py_BuildValue("i", nroots):NULL;
+  int i;
+
+  if (!PyArg_ParseTuple(args, "i", &i)) return NULL;
+  if (!pysaver_checkslots(self, i)) return NULL;
+
+  if (!self->pstandby[i]) {
+    PyErr_SetString(PyExc_RuntimeError, "no standby window on this screen");
+    return NULL;
+  }
+  if (self->damage_event < 0) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  return Py_BuildValue("i", self->pframes[i]);
 }
 
 static PyObject *
-pysaver_activated(PyObject * self, PyObject * args)
+pysaver_swap(DisplayObject * self, PyObject * args)
 {
   int i;
 
   if (!PyArg_ParseTuple(args, "i", &i)) return NULL;
-  if (!pysaver_checkdpy()) return NULL;
-  
-  if (i<0 || i >= nroots) {
-    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+  if (!pysaver_checkslots(self, i)) return NULL;
+
+  if (!self->pstandby[i]) {
+    PyErr_SetString(PyExc_RuntimeError, "no standby window on this screen");
     return NULL;
   }
-  
-  if (pstates[i]) 
-    return Py_BuildValue("i", panes[i]);
+  self->xstatus = 0;
+  XRaiseWindow(self->dpy, self->pstandby[i]);
+  if (self->pshown[i])
+    XDestroyWindow(self->dpy, self->pshown[i]);
+#ifdef HAVE_XDAMAGE
+  if (self->pdamage[i])
+    XDamageDestroy(self->dpy, self->pdamage[i]);
+#endif
+  self->pshown[i] = self->pstandby[i];
+  self->pstandby[i] = self->pdamage[i] = None;
+  self->pready[i] = self->pframes[i] = 0;
+  XFlush(self->dpy);
 
-  Py_INCREF(Py_None);
-  return Py_None;
+  if (self->xstatus) {
+    PyErr_SetString(PyExc_RuntimeError, "An X protocol error occured");
+    return NULL;
+  }
+  return Py_BuildValue("i", self->pshown[i]);
 }
 
-static int
-pysaver_desactivate_low(int i) 
+/*---------------------------------------------------------------------------*/
+static PyObject *
+pysaver_resources(DisplayObject * self, PyObject * args)
 {
-  int status = 1;
-  PyObject * r, * a;
+  int i, panes = 0, surfaces = 0;
+  Py_ssize_t bytes = 0;
 
-  /* This test can seems redundant (see calls in pysaver_pool and
-     pysaver_desactivate), but it is not: that's a fine optimization
-     in case of desactivation by callbacks.
-  */
-  if (pstates[i]) {
-    mydebug("Unmapping pane %i\n", i);
-    XUnmapWindow(dpy, panes[i]);
-
-    /* ...And to run the callback, if one is registered */
-    if (pcallbacks[i]) {
-      if (pkeywords[i])
-	r = PyEval_CallObjectWithKeywords(pcallbacks[i], 
-					  a = Py_BuildValue("()"),
-					  pkeywords[i]);
-      else
-	r = PyEval_CallObject(pcallbacks[i], 
-			      a = Py_BuildValue("()"));
-      
-      Py_XDECREF(a);
-      Py_XDECREF(r);
-      Py_XDECREF(pcallbacks[i]);
-      Py_XDECREF(pkeywords[i]);
-      pcallbacks[i] = NULL;
-      if (!r) status = 0;
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  for (i = 0; i < self->nroots; ++i) {
+    if (self->panes[i])
+      ++panes;
+    if (self->psurfaces[i] && self->psurfaces[i]->image) {
+      ++surfaces;
+      bytes += self->psurfaces[i]->size;
+    }
+  }
+  return Py_BuildValue("{s:i, s:i, s:i, s:n}", "screens", self->nroots,
+		       "panes", panes, "surfaces", surfaces, 
+		       "surface_bytes", bytes);
+}
+
+static PyObject *
+pysaver_stats(DisplayObject * self, PyObject * args, PyObject * kw)
+{
+  static char * kwlist[] = {"reset", NULL};
+  int i, k, n, reset = 0;
+  PyObject * d, * hist, * item;
+  StatsHistogram * h;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|i", kwlist, &reset))
+    return NULL;
+  if (!(d = PyDict_New()))
+    return NULL;
+
+  for (i = 0; i < STATS_COUNT; ++i) {
+    h = &self->stats[i];
+    for (n = STATS_BUCKETS; n > 0 && !h->hist[n-1]; --n);
+    if (!(hist = PyTuple_New(n)))
+      goto error;
+    for (k = 0; k < n; ++k) {
+      if (!(item = PyLong_FromUnsignedLong(h->hist[k]))) {
+	Py_DECREF(hist);
+	goto error;
+      }
+      PyTuple_SET_ITEM(hist, k, item);
     }
-    pstates[i] = 0;
+    if (!(item = Py_BuildValue("(kkN)", h->count, h->total, hist)))
+      goto error;
+    if (PyDict_SetItemString(d, stats_names[i], item) < 0) {
+      Py_DECREF(item);
+      goto error;
+    }
+    Py_DECREF(item);
   }
 
-  return status && !xstatus;
+  if (reset)
+    memset(self->stats, 0, sizeof(self->stats));
+  return d;
+
+ error:
+  Py_DECREF(d);
+  return NULL;
 }
 
+/*---------------------------------------------------------------------------*/
 static PyObject *
-pysaver_desactivate(PyObject * self, PyObject * args)
+pysaver_idletime(DisplayObject * self, PyObject * args)
 {
-  int i;
-  
-  if (!PyArg_ParseTuple(args, "i", &i)) return NULL;
-   if (!pysaver_checkdpy()) return NULL;
-  
-  if (i<0 || i >= nroots) {
-    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+  XSyncValue value;
+  Status ok;
+
+  if (!pysaver_checksync(self)) return NULL;
+  PYSAVER_ROUNDTRIP(self, STATS_COUNTER,
+		    ok = XSyncQueryCounter(self->dpy, self->idle_counter, 
+					   &value));
+  if (!ok) {
+    PyErr_SetString(PyExc_RuntimeError, "could not query IDLETIME counter");
     return NULL;
   }
+  return PyLong_FromLongLong(((PY_LONG_LONG)XSyncValueHigh32(value) << 32) |
+			     XSyncValueLow32(value));
+}
 
-  if (pstates[i]) {
-    if (!pysaver_desactivate_low(i))
-      return NULL;
+static PyObject *
+pysaver_alarm(DisplayObject * self, PyObject * args, PyObject * kw)
+{
+  static char * kwlist[] = {"ms", "negative", NULL};
+  PY_LONG_LONG ms;
+  int negative = 0;
+  XSyncAlarmAttributes attrs;
+  XSyncAlarm alarm;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "L|i", kwlist, &ms, &negative))
+    return NULL;
+  if (!pysaver_checksync(self)) return NULL;
+  if (ms < 0) {
+    PyErr_SetString(PyExc_RuntimeError, "threshold cannot be negative");
+    return NULL;
   }
-#ifdef MYDEBUG
-  else
-    mydebug("Screen %d already desactivated\n", i);
-#endif
 
+  /* Transitions, unlike comparisons, keep the alarm armed after firing */
+  attrs.trigger.counter = self->idle_counter;
+  attrs.trigger.value_type = XSyncAbsolute;
+  XSyncIntsToValue(&attrs.trigger.wait_value, 
+		   (unsigned int)(ms & 0xffffffff), (int)(ms >> 32));
+  attrs.trigger.test_type = 
+    (negative)?XSyncNegativeTransition:XSyncPositiveTransition;
+  XSyncIntToValue(&attrs.delta, 0);
+  attrs.events = True;
+  pysaver_check_begin(self);
+  alarm = XSyncCreateAlarm(self->dpy, 
+			   XSyncCACounter | XSyncCAValueType | XSyncCAValue |
+			   XSyncCATestType | XSyncCADelta | XSyncCAEvents,
+			   &attrs);
+  if (pysaver_check_end(self) || alarm == None) {
+    PyErr_SetString(PyExc_RuntimeError, "could not create alarm");
+    return NULL;
+  }
+  return Py_BuildValue("k", (unsigned long)alarm);
+}
+
+static PyObject *
+pysaver_remove_alarm(DisplayObject * self, PyObject * args)
+{
+  unsigned long alarm;
+
+  if (!PyArg_ParseTuple(args, "k", &alarm)) return NULL;
+  if (!pysaver_checksync(self)) return NULL;
+  XSyncDestroyAlarm(self->dpy, (XSyncAlarm)alarm);
   Py_INCREF(Py_None);
   return Py_None;
 }
 
 static PyObject *
-pysaver_activate(PyObject * self, PyObject * args, PyObject * kw)
+pysaver_alarms(DisplayObject * self, PyObject * args)
 {
-  PyObject * cb = NULL;
-  int i; 
+  int i;
+  PyObject * ret, * item;
 
-  if (!PyArg_ParseTuple(args, "i|O", &i, &cb))
+  if (!pysaver_checkdpy(self)) return NULL;
+  if (!(ret = PyList_New(self->nfired)))
     return NULL;
+  for (i=0; i<self->nfired; ++i) {
+    if (!(item = PyLong_FromUnsignedLong(self->fired[i]))) {
+      Py_DECREF(ret);
+      return NULL;
+    }
+    PyList_SET_ITEM(ret, i, item);
+  }
+  self->nfired = 0;
+  return ret;
+}
 
-  if (!pysaver_checkdpy()) return NULL;
-  
-  if (i<0 || i >= nroots) {
-    PyErr_SetString(PyExc_RuntimeError, "screen number out of bound");
+/*---------------------------------------------------------------------------*/
+static PyObject *
+pysaver_inputs(DisplayObject * self, PyObject * args)
+{
+  int i;
+  PyObject * l, * item;
+
+  if (!pysaver_checkdpy(self)) return NULL;
+  if (!self->rdpy) {
+    PyErr_SetString(PyExc_RuntimeError, "input is not recorded");
     return NULL;
   }
 
-  if (cb && !PyCallable_Check(cb)) {
-    PyErr_SetString(PyExc_RuntimeError, "callback parameter is not callable");
+  if (!(l = PyList_New(0)))
     return NULL;
-  }
-  
-  if (!pstates[i]) {
-    mydebug("Activating screen %d\n", i);
-    XMapWindow(dpy, panes[i]);
-    XRaiseWindow(dpy, panes[i]);
-    Py_XINCREF(cb);
-    pstates[i] = 1;
-    pcallbacks[i] = cb;
-    if (kw) {
-      Py_XINCREF(kw);
-      pkeywords[i] = kw;
+  for (i = 0; i < self->nroots; ++i)
+    if (self->pinputs[i]) {
+      if (!(item = PyInt_FromLong(i)) || PyList_Append(l, item) < 0) {
+	Py_XDECREF(item);
+	Py_DECREF(l);
+	return NULL;
+      }
+      Py_DECREF(item);
+      self->pinputs[i] = 0;
     }
-    
-  }
-#ifdef MYDEBUG
-  else 
-    mydebug("Screen %d already activated\n", i);
-#endif
-
-  return Py_BuildValue("i", panes[i]);
+  return l;
 }
 
 /*---------------------------------------------------------------------------*/
 static PyObject *
-pysaver_pool(PyObject * self, PyObject * args)
+pysaver_fileno(DisplayObject * self, PyObject * args)
 {
-  char keys[32];
-  int i, j, x, y;
-  Window dummy;
-  XEvent ev;
-  
-  if (!pysaver_checkdpy()) return NULL;
+  return (pysaver_checkdpy(self))?
+    Py_BuildValue("i", ConnectionNumber(self->dpy)):NULL;
+}
 
-  xstatus = 0;
-  while (!xstatus && XCheckMaskEvent(dpy, EVENT_MASK, &ev)==True) {
-#ifdef MYDEBUG
-    j = 0;
-#endif
-    /* Identify the pane */
-    for (i=0; i<nroots; ++i)
-      if (panes[i] == ev.xany.window)
-	break;
-    
-    /* Discard events on now unmmaped panes */
-    if (!pstates[i]) continue;
-
-    /* Act on event */
-    switch(ev.type) {
-    case Expose:
-      XFillRectangle(dpy, panes[i], gc[i], 
-		     ev.xexpose.x, ev.xexpose.y, 
-		     ev.xexpose.width, ev.xexpose.height);
-      mydebug("Expose, pane %d\n", i);
-      break;
-#ifdef MYDEBUG
-#define MYCASE(evt) case evt: if (!j) mydebug("event: " #evt "\n"); j = 1
-#else
-#define MYCASE(evt) case evt:
-#endif
-      MYCASE(MotionNotify);
-      if ((abs(ev.xmotion.x_root-pxy[2*i]) <= hyst) &&
-	  (abs(ev.xmotion.y_root-pxy[2*i+1]) <= hyst))
-	break;
-      MYCASE(ButtonPress);
-      MYCASE(KeyPress);
-      MYCASE(KeyRelease);
-      /* Time to perform the unmapping... Bail out in case of error */
-      if (!pysaver_desactivate_low(i)) return NULL;
-      break;
-#undef MYCASE
-    default:
-      mydebug("Ouch! Unhandled event: looks like there is a bug looming...\n");
-    }
+static PyObject *
+pysaver_record_fileno(DisplayObject * self, PyObject * args)
+{
+  if (!pysaver_checkdpy(self)) return NULL;
+  if (!self->rdpy) {
+    Py_INCREF(Py_None);
+    return Py_None;
   }
+  return Py_BuildValue("i", ConnectionNumber(self->rdpy));
+}
 
-  /* Query the pointer */
-  for (i=0; i<nroots; ++i)
-    if (XQueryPointer(dpy, panes[i], 
-		      &dummy, &dummy, 
-		      &x, &y, 
-		      &j, &j, (unsigned int*)&j) == True)
-      break;
+/* Convert a sequence of file descriptors (or objects with a fileno()
+   method) into pollfd structures
+ */
+static int
+pysaver_pollfds(PyObject * seq, struct pollfd * pfds, short events)
+{
+  int i, n;
+  PyObject * item;
+
+  for (i = 0, n = PySequence_Fast_GET_SIZE(seq); i < n; ++i) {
+    item = PySequence_Fast_GET_ITEM(seq, i);
+    if ((pfds[i].fd = PyObject_AsFileDescriptor(item)) < 0)
+      return 0;
+    pfds[i].events = events;
+    pfds[i].revents = 0;
+  }
+  return 1;
+}
 
-  /* Query the keyboard */
-  if (XQueryKeymap(dpy, keys) == True) {
-    for(j=0; j<32; ++j)
-      if (keys[j])
-	break;
-  } else
-    j = 32;
+static PyObject *
+pysaver_ready(PyObject * seq, struct pollfd * pfds)
+{
+  int i, n;
+  PyObject * ret, * item;
 
-  if (xstatus) {
-    PyErr_SetString(PyExc_RuntimeError, "An X protocol error occured");
+  if (!(ret = PyList_New(0)))
     return NULL;
+  for (i = 0, n = PySequence_Fast_GET_SIZE(seq); i < n; ++i)
+    if (pfds[i].revents) {
+      item = PySequence_Fast_GET_ITEM(seq, i);
+      if (PyList_Append(ret, item) != 0) {
+	Py_DECREF(ret);
+	return NULL;
+      }
+    }
+  return ret;
+}
+
+static PyObject *
+pysaver_wait(DisplayObject * self, PyObject * args, PyObject * kw)
+{
+  static char * kwlist[] = {"timeout", "readers", "writers", NULL};
+  PyObject * timeout = Py_None, * readers = NULL, * writers = NULL,
+    * empty = NULL, * rseq = NULL, * wseq = NULL, 
+    * rready = NULL, * wready = NULL, * ret = NULL;
+  struct pollfd * pfds = NULL;
+  int n, nr, nw, ms, xready;
+  double t;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|OOO", kwlist, 
+				   &timeout, &readers, &writers))
+    return NULL;
+  if (!pysaver_checkdpy(self)) return NULL;
+
+  if (timeout == Py_None)
+    ms = -1;
+  else {
+    if ((t = PyFloat_AsDouble(timeout)) == -1. && PyErr_Occurred())
+      return NULL;
+    /* Rounded up: a deadline less than a millisecond away must not
+       turn into polls with no timeout until it is due */
+    ms = (t > 0)?(int)(t * 1000):0;
+    if (ms < t * 1000) ++ms;
   }
 
-  if (i<nroots) {
-    if (!pstates[i]) {
-      pxy[i*2]   = x;
-      pxy[i*2+1] = y;
-    }
-    return Py_BuildValue("(i, ((i, i), O))", 
-			 i, x, y, (j>=32)?Py_False:Py_True);
-  } else
-    return Py_BuildValue("(O, ((i, i), O))", Py_None, 0, 0, Py_False);
+  if (!(empty = PyTuple_New(0)) ||
+      !(rseq = PySequence_Fast((readers && readers != Py_None)?
+			       readers:empty, "readers is not a sequence")) ||
+      !(wseq = PySequence_Fast((writers && writers != Py_None)?
+			       writers:empty, "writers is not a sequence")))
+    goto done;
+  nr = PySequence_Fast_GET_SIZE(rseq);
+  nw = PySequence_Fast_GET_SIZE(wseq);
+  if (!(pfds = PyMem_New(struct pollfd, nr + nw + 1))) {
+    PyErr_SetString(PyExc_RuntimeError, "memory allocation problem");
+    goto done;
+  }
+  if (!pysaver_pollfds(rseq, pfds, POLLIN) ||
+      !pysaver_pollfds(wseq, &pfds[nr], POLLOUT))
+    goto done;
+  pfds[nr + nw].fd = ConnectionNumber(self->dpy);
+  pfds[nr + nw].events = POLLIN;
+  pfds[nr + nw].revents = 0;
+
+  /* Events may already sit in Xlib queue, where poll() cannot see them */
+  if ((xready = XEventsQueued(self->dpy, QueuedAfterFlush) > 0))
+    ms = 0;
+
+  PYSAVER_UNLOCKED(self, 
+		   while ((n = poll(pfds, nr + nw + 1, ms)) < 0 && 
+			  errno == EINTR));
+
+  if (n < 0) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    goto done;
+  }
+
+  xready = xready || (pfds[nr + nw].revents && 
+		      XEventsQueued(self->dpy, QueuedAfterReading) > 0);
+  if ((rready = pysaver_ready(rseq, pfds)) &&
+      (wready = pysaver_ready(wseq, &pfds[nr])))
+    ret = Py_BuildValue("(OOO)", (xready)?Py_True:Py_False, rready, wready);
+
+ done:
+  Py_XDECREF(rready);
+  Py_XDECREF(wready);
+  Py_XDECREF(rseq);
+  Py_XDECREF(wseq);
+  Py_XDECREF(empty);
+  if (pfds) PyMem_Free(pfds);
+  return ret;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -641,46 +2565,216 @@ Remove shield from SIGCHLD (see block())"},
 Returns the `name' of the display that connect() would attempt to use.\n\
 If name is unspecified, the locally implemented lookup mechanism from X\n\
 will be used (see documenation to XDisplayName call)"},
+#ifdef __linux__
+  { "signalfd", pysaver_signalfd, METH_VARARGS,
+    "signalfd(signals) => fd\n\
+Block the given sequence of signals for good, and return a non-blocking\n\
+file descriptor they can be read from instead (see signals())."},
+  { "signals", pysaver_signals, METH_VARARGS,
+    "signals(fd) => [signo, ...]\n\
+Read all the signals pending on a file descriptor from signalfd()."},
+  { "inotify", pysaver_inotify, METH_NOARGS,
+    "inotify() => fd\n\
+Return a non-blocking file descriptor files changes can be read from\n\
+(see watch() and changes())."},
+  { "watch", pysaver_watch, METH_VARARGS,
+    "watch(fd, path) => wd\n\
+Watch the files written or moved into the given directory, on a file\n\
+descriptor from inotify(), returning the watch descriptor."},
+  { "changes", pysaver_changes, METH_VARARGS,
+    "changes(fd) => [(wd, name), ...]\n\
+Read all the changes pending on a file descriptor from inotify(), as\n\
+the names of the files changed in each watched directory."},
+#endif
+  {0}
+};
+
+static PyMethodDef displayMethods[] = {
   { "connect", (PyCFunction)pysaver_connect, METH_VARARGS | METH_KEYWORDS,
-    "connect(name=None, visuals={}, hysteresis=0) => None\n\
+    "connect(name=None, visuals={}, hysteresis=0, outputs=False,\n\
+        record=False, release=-1) => None\n\
 Connect to X server named `name' (it connects to default display if no\n\
 name given), and initialize the screensaver, using default depth and\n\
 visuals ID provided as dictionnary values, keyed by screen number\n\
 (if no key/value pair is provided, default visual for each screen is\n\
 used). `hysteresis' specify the tolerated pointer slew in pixels for\n\
-not desactivating the screen saver. This must be called before any\n\
-other call to this module but connected(), display_name(), block()\n\
-or unblock()." },
-  { "disconnect", pysaver_disconnect, METH_NOARGS,
+not desactivating the screen saver. If `outputs' is true and the module\n\
+was built with RandR support, one pane is created per active monitor\n\
+instead of one per screen: all other calls then take pane numbers\n\
+where screen numbers are mentioned (see geometry()). If `record' is\n\
+true and the module was built with RECORD support, all input is\n\
+captured as well (see inputs()). If `release' is not negative, panes\n\
+are only created on activation, and released after `release' seconds\n\
+without one (see resources()). This must be called before any other\n\
+call to this module but connected(), display_name(), block() or\n\
+unblock()." },
+  { "disconnect", (PyCFunction)pysaver_disconnect, METH_NOARGS,
     "disconnect() => None\n\
 Disconnect from X server." },
   { "connected", (PyCFunction)pysaver_connected, METH_NOARGS,
     "connected() => state\n\
 Return connection state as a boolean." },
-  { "screens", pysaver_screens, METH_NOARGS,
+  { "screens", (PyCFunction)pysaver_screens, METH_NOARGS,
     "screens() => number_of_screens\n\
-Return the number of screens on current X display as an integer." },
+Return the number of screens on current X display as an integer or,\n\
+with per-output panes, the number of panes (see connect())." },
   { "activate", (PyCFunction)pysaver_activate, METH_VARARGS | METH_KEYWORDS, 
     "activate(screen_num, callback=None, ...) => id\n\
 Activate the given screen, while returning the window numeric ID as an\n\
 integer. If specified, callback needs to be a callable that will be\n\
 invoked right before desactivation: all remaining keywords arguments,\n\
 if any, will be passed to the callback." },
-  { "desactivate", pysaver_desactivate, METH_VARARGS,
+  { "desactivate", (PyCFunction)pysaver_desactivate, METH_VARARGS,
     "desactivate(screen_num) => None\n\
 Force desactivation of the given screen: if a callback is registered\n\
 (see activate), it is called appropriately. " },
-  { "activated", pysaver_activated, METH_VARARGS,
+  { "activated", (PyCFunction)pysaver_activated, METH_VARARGS,
     "activated(screen_num) => id\n\
 Return whether or not a given screen is currently activated. If it is,\n\
 it returns the window's id on this screen. If it is not, it returns\n\
 None." },
-  { "pool", pysaver_pool, METH_NOARGS,
+  { "visible", (PyCFunction)pysaver_visible, METH_VARARGS,
+    "visible(screen_num) => state\n\
+Return whether the given screen is activated and its pane not fully\n\
+obscured by other windows, as last collected by pool(): what the pane\n\
+shows can then be seen, provided the monitors are powered (see dpms())." },
+  { "geometry", (PyCFunction)pysaver_geometry, METH_VARARGS,
+    "geometry(screen_num) => (screen, (x, y, width, height), output)\n\
+Return where a given pane lies: its X screen, its geometry on it, and\n\
+the name of the RandR output it covers (None for a whole screen)." },
+  { "layout_changed", (PyCFunction)pysaver_layout_changed, METH_NOARGS,
+    "layout_changed() => state\n\
+Return whether pool() saw the monitors layout change since the panes\n\
+were last built, in which case relayout() should be called." },
+  { "relayout", (PyCFunction)pysaver_relayout, METH_NOARGS,
+    "relayout() => number_of_screens\n\
+Desactivate all the panes (see desactivate()), then rebuild them\n\
+following the current monitors layout. If they cannot be rebuilt, the\n\
+display is disconnected." },
+  { "dpms", (PyCFunction)pysaver_dpms, METH_VARARGS,
+    "dpms(level=None) => (level, enabled)\n\
+Force the display power level to `level' if given ('on', 'standby',\n\
+'suspend' or 'off'), then return the current level and whether DPMS\n\
+is enabled. DPMS is enabled as needed, and disabled again when forcing\n\
+the power back on if it was not enabled in the first place. Please\n\
+note that power levels apply to all the monitors of the display." },
+  { "surface", (PyCFunction)pysaver_surface, METH_VARARGS,
+    "surface(screen_num) => (buffer, width, height, bytes_per_line, bpp)\n\
+Return a writable buffer (a memoryview) over an MIT-SHM image the size\n\
+of the given pane, created on first call, along with its geometry: the\n\
+pixels are laid out following the pane visual, `bytes_per_line' apart,\n\
+`bpp' bits each. Nothing is drawn until present() is called; after\n\
+that, exposures are repaired from the image instead of blanking, until\n\
+the pane gets desactivated. The image goes away with its pane, at\n\
+disconnection or relayout() time." },
+  { "present", (PyCFunction)pysaver_present, METH_VARARGS,
+    "present(screen_num, rectangles=None) => None\n\
+Push the given rectangles of the pane image to the screen (the whole\n\
+image if None), as a sequence of (x, y, width, height) tuples. The\n\
+server reads the shared memory asynchronously: drawing right away over\n\
+rectangles just presented may show up on screen." },
+  { "fade", (PyCFunction)pysaver_fade, METH_VARARGS,
+    "fade(screen_num, duration) => None\n\
+Capture what the given screen currently shows into its surface (see\n\
+surface()), so that once activated the pane starts from it, and darkens\n\
+to black over `duration' seconds. Each step is performed by pool(), that\n\
+should then be called often enough (see fading()); any activity\n\
+desactivating the pane drops the fade right away. This must be called\n\
+before activate(), and it raises RuntimeError if MIT-SHM is unavailable,\n\
+or if the pane does not use the default visual at 24 or 32 bpp." },
+  { "fading", (PyCFunction)pysaver_fading, METH_NOARGS,
+    "fading() => state\n\
+Return whether some fades are pending or in progress (see fade())." },
+  { "standby", (PyCFunction)pysaver_standby, METH_VARARGS,
+    "standby(screen_num) => window\n\
+Return a window covering the given activated pane, created on first\n\
+call and mapped below what the pane shows, for a program to start\n\
+drawing into out of sight (see ready() and swap()). It goes away with\n\
+the pane desactivation. What the pane shows must itself be such a window,\n\
+swapped in: the standby one would otherwise cover the pane contents." },
+  { "ready", (PyCFunction)pysaver_standby_ready, METH_VARARGS,
+    "ready(screen_num) => state\n\
+Return whether the standby window of the given pane was drawn upon since\n\
+its creation, as collected by pool(), or None when the DAMAGE extension\n\
+is unavailable to tell." },
+  { "frames", (PyCFunction)pysaver_frames, METH_VARARGS,
+    "frames(screen_num) => count\n\
+Return how many times the standby window of the given pane was drawn\n\
+upon since its creation, as collected by pool(): successive drawings\n\
+not collected in between count as one. It is None when the DAMAGE\n\
+extension is unavailable (see ready())." },
+  { "swap", (PyCFunction)pysaver_swap, METH_VARARGS,
+    "swap(screen_num) => window\n\
+Raise the standby window of the given pane, to be shown from now on in\n\
+place of the previous one (destroyed if it was not the pane itself)." },
+  { "resources", (PyCFunction)pysaver_resources, METH_NOARGS,
+    "resources() => {'screens': n, 'panes': n, 'surfaces': n, ...}\n\
+Return the number of screens, how many of them currently hold a pane\n\
+in the server (a window, a GC and a cursor each) or a surface, and the\n\
+size of these surfaces in bytes, as 'surface_bytes'." },
+  { "stats", (PyCFunction)pysaver_stats, METH_VARARGS | METH_KEYWORDS,
+    "stats(reset=False) => {kind: (count, total, histogram), ...}\n\
+Return what this connection cost so far, as counters kept for its whole\n\
+life, and reset them afterward if `reset' is true. Each kind has its\n\
+count of samples, their sum, and their log2 histogram as a tuple where\n\
+item k counts the samples from 2**(k-1) to 2**k - 1 (item 0 counting\n\
+zeros), trailing empty items omitted. The kinds are X round trips, timed\n\
+in microseconds: 'sync', 'pointer', 'keymap', 'counter' (IDLETIME),\n\
+'dpms', 'image' (see fade()) and 'randr'; 'events', the number of events\n\
+drained by each pool() call; 'callbacks', the microseconds spent in the\n\
+desactivation callbacks (see activate()); and 'expose', the microseconds\n\
+from activation to the first Expose event of a pane, that is until it\n\
+can be drawn into." },
+  { "idletime", (PyCFunction)pysaver_idletime, METH_NOARGS,
+    "idletime() => ms\n\
+Return the time elapsed since the last input on the whole display, in\n\
+milliseconds, as maintained by the server itself through the XSync\n\
+IDLETIME counter. It raises RuntimeError if the counter is unavailable." },
+  { "alarm", (PyCFunction)pysaver_alarm, METH_VARARGS | METH_KEYWORDS,
+    "alarm(ms, negative=False) => id\n\
+Register a server-side alarm on the IDLETIME counter, firing each time\n\
+the display idle time rises through `ms' milliseconds or, if `negative'\n\
+is true, each time it falls back below it (i.e. on the first input\n\
+after at least `ms' of idleness). Fired alarms show up as X events (see\n\
+wait()) and are reported by alarms() after pool() processed them." },
+  { "remove_alarm", (PyCFunction)pysaver_remove_alarm, METH_VARARGS,
+    "remove_alarm(id) => None\n\
+Unregister an alarm created by alarm()." },
+  { "alarms", (PyCFunction)pysaver_alarms, METH_NOARGS,
+    "alarms() => [id, ...]\n\
+Return the ids of the alarms fired since last call, in order." },
+  { "inputs", (PyCFunction)pysaver_inputs, METH_NOARGS,
+    "inputs() => [screen_num, ...]\n\
+Return the screens that saw some input since last call, as recorded by\n\
+pool() from every key, button and motion event the server processed,\n\
+regardless of grabs or of the polling rate; pointer motion only counts\n\
+beyond the hysteresis (see connect()). It raises RuntimeError if input\n\
+is not recorded." },
+  { "fileno", (PyCFunction)pysaver_fileno, METH_NOARGS,
+    "fileno() => fd\n\
+Return the file descriptor of the X connection, as an integer." },
+  { "record_fileno", (PyCFunction)pysaver_record_fileno, METH_NOARGS,
+    "record_fileno() => fd\n\
+Return the file descriptor of the connection input is recorded from\n\
+(see inputs()), or None: once readable, pool() has input to collect." },
+  { "wait", (PyCFunction)pysaver_wait, METH_VARARGS | METH_KEYWORDS,
+    "wait(timeout=None, readers=(), writers=()) => (x, rready, wready)\n\
+Block until X events are available, any of the `readers' is ready for\n\
+reading, any of the `writers' is ready for writing, or `timeout'\n\
+seconds (a float rounded up to the millisecond, None meaning forever)\n\
+elapsed, without holding the interpreter lock. `readers' and `writers'\n\
+are sequences of file descriptors or objects with a fileno() method,\n\
+just like with select.select(). It returns whether X events are\n\
+pending (that pool() should process), and the lists of ready readers\n\
+and writers." },
+  { "pool", (PyCFunction)pysaver_pool, METH_NOARGS,
     "pool() => (screen, ((x, y), keyboard_active))\n\
 First process all X events received since last call, and then\n\
 query the X pointer and keyboard. It returns the screen id\n\
 (None if the pointer could not be found), the pointer's coordinates\n\
-as integers, and the keyboard current activity as boolean.\n\
+as integers, and the keyboard current activity as boolean: it is also\n\
+true if any key or button was pressed on a pane since last call, the\n\
+screen then being the one of such a pane if the pointer was not found.\n\
 \n\
 IMPORTANT: This should be run in a relatively tight loop (at \n\
 least a couple of hertz) once we connect()'ed, the reason being that\n\
@@ -689,10 +2783,89 @@ use instant queries (XQueryPointer, XQueryKeymap)." },
   {0}
 };
 
+/*---------------------------------------------------------------------------*/
+static void
+pysaver_dealloc(DisplayObject * self)
+{
+  if (self->dpy) {
+    pysaver_panes_destroy(self);
+    pysaver_xcleanup(self);
+  }
+  self->ob_type->tp_free((PyObject*)self);
+}
+
+/*---------------------------------------------------------------------------*/
+static int
+pysaver_surface_getbuffer(SurfaceObject * self, Py_buffer * view, int flags)
+{
+  return PyBuffer_FillInfo(view, (PyObject *)self, self->shminfo.shmaddr,
+			   self->size, 0, flags);
+}
+
+static void
+pysaver_surface_dealloc(SurfaceObject * self)
+{
+  if (self->shminfo.shmaddr != (char *)-1)
+    shmdt(self->shminfo.shmaddr);
+  self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyBufferProcs SurfaceBuffer = {
+  0, 0, 0, 0,
+  (getbufferproc)pysaver_surface_getbuffer,	/* bf_getbuffer */
+  0						/* bf_releasebuffer */
+};
+
+static PyTypeObject SurfaceType = {
+  PyObject_HEAD_INIT(NULL)
+  0,					/* ob_size */
+  "pysaver.Surface",			/* tp_name */
+  sizeof(SurfaceObject),		/* tp_basicsize */
+  0,					/* tp_itemsize */
+  (destructor)pysaver_surface_dealloc,	/* tp_dealloc */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  &SurfaceBuffer,			/* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER,	/* tp_flags */
+  "Pane image shared with the X server (see surface())",
+};
+
+/*---------------------------------------------------------------------------*/
+static PyTypeObject DisplayType = {
+  PyObject_HEAD_INIT(NULL)
+  0,					/* ob_size */
+  "pysaver.Display",			/* tp_name */
+  sizeof(DisplayObject),		/* tp_basicsize */
+  0,					/* tp_itemsize */
+  (destructor)pysaver_dealloc,		/* tp_dealloc */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  Py_TPFLAGS_DEFAULT,			/* tp_flags */
+  "Display() => display\n\
+Connection to an X display, with its own panes: it offers all of this\n\
+module functions as methods but block(), unblock() and display_name(),\n\
+the module-level functions working on a default instance. Distinct\n\
+instances can be used concurrently from different threads, as the\n\
+interpreter lock is released around X round trips; a call on an\n\
+instance busy in another thread raises RuntimeError.",
+  0, 0, 0, 0, 0, 0,
+  displayMethods,			/* tp_methods */
+};
+
 PyMODINIT_FUNC
 initpysaver(void)
 {
-  Py_InitModule3("pysaver", pysaverMethods, "\
+  PyObject * m, * meth;
+  PyMethodDef * def;
+
+  /* Connections may be used from different threads */
+  XInitThreads();
+  if (!(plock = PyThread_allocate_lock()))
+    return;
+
+  DisplayType.tp_new = PyType_GenericNew;
+  if (PyType_Ready(&DisplayType) < 0 || PyType_Ready(&SurfaceType) < 0)
+    return;
+
+  if (!(m = Py_InitModule3("pysaver", pysaverMethods, "\
 xlamesaver daemon core functionnality module.\n\
 \n\
 pysaver exposes to python the minimum needed to implement a simple \n\
@@ -700,15 +2873,30 @@ multiheads screensaver daemon for the X Window System. Typical usage\n\
 goes like this:\n\
 \n\
 from pysaver import *\n\
-from time import sleep\n\
 connect()\n\
 try:\n\
    while True:\n\
       print 'Pointer and keyboard info:', pool()\n\
-      sleep(.1)\n\
+      wait(.1)\n\
 finally:\n\
    disconnect()\n\
 \n\
+Several displays can be managed at once through Display instances,\n\
+offering the same functions as methods.\n\
+\n\
 See xlamesaver python source for a more complete example.\n\
-");
+")))
+    return;
+
+  Py_INCREF(&DisplayType);
+  PyModule_AddObject(m, "Display", (PyObject *)&DisplayType);
+
+  /* Module-level functions are the methods of the default instance */
+  if (!(pdefault = (DisplayObject *)
+	PyObject_CallObject((PyObject *)&DisplayType, NULL)))
+    return;
+  for (def = displayMethods; def->ml_name; ++def)
+    if (!(meth = PyObject_GetAttrString((PyObject *)pdefault, def->ml_name))
+	|| PyModule_AddObject(m, def->ml_name, meth) < 0)
+      return;
 }
@@ -40,8 +40,12 @@ setup(name='xlamesaver',
       license='BSD', 
       ext_modules=[Extension('pysaver',
                              sources=['pysaver.c'],
-                             libraries = ['X11'],
-                             extra_compile_args = ['-Wall', # '-DMYDEBUG'
+                             libraries = ['X11', 'Xext', # 'Xrandr', 'Xtst',
+                                          # 'Xdamage'
+                                          ],
+                             extra_compile_args = ['-Wall', # '-DMYDEBUG', '-DHAVE_XRANDR',
+                                                   # '-DHAVE_XRECORD',
+                                                   # '-DHAVE_XDAMAGE'
                                                    ],
                              extra_link_args = []
                              )
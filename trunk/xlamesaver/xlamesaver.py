@@ -105,13 +105,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 # Modules
 #
 from __future__ import with_statement
-from contextlib import closing
+from contextlib import closing, nested
 
 import sys, traceback, logging
-import os, os.path, time, re
+import os, os.path, time, re, errno
 import subprocess, signal
-import asyncore, asynchat, socket
-import random, textwrap, pprint, optparse
+import select, socket
+import random, textwrap, pprint, optparse, copy, json
+import heapq, itertools, collections, ast
 import pysaver
 
 #-------------------------------------------------------------------------------
@@ -123,8 +124,11 @@ class Monitor:
   SIGCHLD signal interruption
   """
   _count = 0	# We do refcounting to allow recursive calls
+  sigfd  = None	# Where SIGCHLD is read from, once taken over (see shield())
 
   def __call__(self, func, *args, **kw):
+    if self.sigfd is not None:
+      return func(*args, **kw)
     self._count += 1
     pysaver.block()
     try:
@@ -134,15 +138,560 @@ class Monitor:
       if self._count == 0: pysaver.unblock()
     return ret
 
+  def shield(self):
+    """
+    Take SIGCHLD over for good, when the platform allows it: it is
+    then blocked, and read from a file descriptor (returned, None
+    otherwise) by the daemon loop, that collects the zombies (see
+    reap()). Protected regions are then no longer needed.
+    """
+    if self.sigfd is None and hasattr(pysaver, 'signalfd'):
+      self.sigfd = pysaver.signalfd([signal.SIGCHLD])
+    return self.sigfd
+
+  def reap(self, *args):
+    """Collect all the zombies (see Supervisor.reap())"""
+    if self.sigfd is not None:
+      pysaver.signals(self.sigfd)
+    _supervisor.reap()
+
 _protect = Monitor()	# Monitor being basically a singleton, let's create
 		        # an instance right away.
 
+#-------------------------------------------------------------------------------
+class Supervisor:
+  """
+  Keep track of the children processes: every exit is collected,
+  along with its status and resource usage, and children asked to
+  terminate are killed for good, process group included, if they did
+  not comply within their grace period (see escalate()). Children can
+  also be paused as a whole, for as long as any reason holds (see
+  pause()), or one by one (see hold()).
+  """
+  def __init__(self, history=32):
+    self.children = {}				# pid => child
+    self.dying    = []				# (deadline, pid) heap
+    self.doomed   = {}				# pid => cgroup, if not gone
+    self.exited   = collections.deque(maxlen=history)
+    self.holds    = set()			# Reasons to keep them stopped
+
+  def add(self, child):
+    self.children[child.pid] = child
+    if self.stopped(child): self.signal(child.pid, signal.SIGSTOP)
+
+  def stopped(self, child):
+    return bool(self.holds or child.holds)
+
+  def pause(self, reason):
+    """Stop all the children process groups, until `reason' is resumed"""
+    if not self.holds:
+      for pid in self.children: self.signal(pid, signal.SIGSTOP)
+    self.holds.add(reason)
+
+  def resume(self, reason):
+    """Continue the children, once no reason to pause them is left"""
+    if reason not in self.holds: return
+    self.holds.discard(reason)
+    for child in self.children.values():
+      if not self.stopped(child): self.cont(child)
+
+  def hold(self, child, reason):
+    """Stop `child' process group, until `reason' is released for it"""
+    if not self.stopped(child): self.signal(child.pid, signal.SIGSTOP)
+    child.holds.add(reason)
+
+  def release(self, child, reason):
+    if reason not in child.holds: return
+    child.holds.discard(reason)
+    if not self.stopped(child): self.cont(child)
+
+  def cont(self, child):
+    self.signal(child.pid, signal.SIGCONT)
+    child.resumed = time.time()
+
+  def terminate(self, child, grace):
+    """Politely ask `child' process group to quit, for `grace' seconds"""
+    # Once the group is gone, its id may belong to anybody
+    if (child.returncode is not None and
+        not self.populated(child.pid, child.cgroup)): return
+    self.signal(child.pid, signal.SIGQUIT)
+    # Stopped, it would never get to it
+    if self.stopped(child): self.signal(child.pid, signal.SIGCONT)
+    heapq.heappush(self.dying, (time.time() + grace, child.pid))
+    self.doomed[child.pid] = child.cgroup
+
+  def populated(self, pgid, cgroup):
+    """Whether a child group still holds processes"""
+    if cgroup is not None:
+      return _cgroups.populated(cgroup)
+    try:
+      os.killpg(pgid, 0)
+    except OSError:
+      return False
+    return True
+
+  def signal(self, pgid, signum):
+    try:
+      os.killpg(pgid, signum)
+    except OSError: pass
+
+  def reap(self):
+    """
+    Collect every pending zombie: signals being coalesced, one SIGCHLD
+    may stand for any number of them
+    """
+    while True:
+      try:
+        pid, status, rusage = os.wait4(-1, os.WNOHANG)
+      except OSError: break
+      if not pid: break
+      child = self.children.pop(pid, None)
+      if child is None: continue
+      # Its group may be left over, or else no longer needs killing
+      if (self.doomed.has_key(pid) and
+          not self.populated(pid, child.cgroup)):
+        del self.doomed[pid]
+      child.exited(status, rusage)
+      _budget.account(child)
+      self.exited.append((pid, child.command, child.returncode,
+                          rusage.ru_utime, rusage.ru_stime,
+                          rusage.ru_maxrss, _cgroups.collect(child.cgroup)))
+      logging.debug('Child %d (%s) exited with %d, ' 
+                    'user %.2fs, system %.2fs, max rss %d kB' %
+                    self.exited[-1][:-1])
+    _cgroups.sweep()
+
+  def next_deadline(self):
+    """Time by which escalate() needs to be called, if any"""
+    while self.dying and not self.doomed.has_key(self.dying[0][1]):
+      heapq.heappop(self.dying)
+    return self.dying[0][0] if self.dying else None
+
+  def escalate(self, now=None):
+    """Kill the process groups still alive past their grace period"""
+    if now is None: now = time.time()
+    while self.dying and self.dying[0][0] <= now:
+      deadline, pgid = heapq.heappop(self.dying)
+      if not self.doomed.has_key(pgid): continue
+      # The group may outlive its leader: the whole cgroup, escapees
+      # included, is killed where there is one
+      cgroup = self.doomed.pop(pgid)
+      if cgroup is not None:
+        _cgroups.kill(cgroup)
+      else:
+        self.signal(pgid, signal.SIGKILL)
+
+  def report(self):
+    """
+    Children running, and the last ones that exited, along with their
+    accounting (see Cgroups.usage())
+    """
+    return {'running': [(pid, child.command, _cgroups.usage(child.cgroup))
+                        for pid, child in sorted(self.children.items())],
+            'exited': list(self.exited), 'paused': sorted(self.holds)}
+
+_supervisor = Supervisor()
+
+#-------------------------------------------------------------------------------
+class Cgroups:
+  """
+  Resource governance of the children through cgroup v2: once set up
+  on a delegated subtree, each child gets a leaf of its own there,
+  limited as asked for (any interface files, such as 'cpu.max',
+  'memory.max' or 'pids.max'), and accounted for until collected.
+  Nothing is done until setup() succeeds.
+  """
+  controllers = ('cpu', 'memory', 'pids')
+
+  def __init__(self):
+    self.base  = None
+    self.stale = []				# Leaves left to remove
+    self.seq   = itertools.count()
+
+  def setup(self, path=True):
+    """
+    Take over a delegated cgroup directory: `path', or the one of the
+    daemon if True. The daemon then moves to a 'daemon' leaf, as
+    cgroup v2 only allows processes in leaves; it stays where it is
+    unless the directory is delegated to it, with all the
+    `controllers' available there.
+    """
+    if not path: return False
+    try:
+      if path is True:
+        with file('/proc/self/cgroup') as f:
+          rel = [line.strip()[3:] for line in f if line.startswith('0::')][0]
+        mount = '/sys/fs/cgroup'
+        if not os.path.isfile(os.path.join(mount, 'cgroup.controllers')):
+          mount = os.path.join(mount, 'unified')
+        path = os.path.normpath(os.path.join(mount, rel.lstrip('/')))
+      for name in ('cgroup.subtree_control', 'cgroup.procs'):
+        if not os.access(os.path.join(path, name), os.W_OK):
+          raise OSError(errno.EACCES, 'not delegated',
+                        os.path.join(path, name))
+      missing = set(self.controllers).difference(
+        self._read(path, 'cgroup.controllers').split())
+      if missing:
+        raise OSError(errno.ENOTSUP, 'controllers %s not available' %
+                      ', '.join(sorted(missing)), path)
+      daemon = os.path.join(path, 'daemon')
+      if not os.path.isdir(daemon): os.mkdir(daemon)
+      self._write(daemon, 'cgroup.procs', os.getpid())
+      try:
+        self._write(path, 'cgroup.subtree_control',
+                    ' '.join(['+' + c for c in self.controllers]))
+      except IOError:
+        self._write(path, 'cgroup.procs', os.getpid())
+        raise
+    except (IOError, OSError, IndexError), e:
+      logging.error('Could not set up cgroups, hacks run unlimited: %s' % e)
+      return False
+    logging.info('Hacks run in cgroups under %s' % path)
+    self.base = path
+    return True
+
+  def _write(self, path, name, value):
+    with file(os.path.join(path, name), 'w') as f:
+      f.write(str(value))
+
+  def _read(self, path, name):
+    with file(os.path.join(path, name)) as f:
+      return f.read()
+
+  def leaf(self, limits=None):
+    """Create a leaf with the given limits, returning its path"""
+    if self.base is None: return None
+    path = os.path.join(self.base, 'hack-%d' % self.seq.next())
+    try:
+      os.mkdir(path)
+      for name, value in (limits or {}).iteritems():
+        self._write(path, name, value)
+    except (IOError, OSError), e:
+      logging.error('Hack cgroup not set: %s' % e)
+      self.stale.append(path)
+      return None
+    return path
+
+  def join(self, path):
+    """Move the calling process to the leaf, if any"""
+    if path is not None:
+      try:
+        self._write(path, 'cgroup.procs', 0)
+      except (IOError, OSError): pass
+
+  def usage(self, path):
+    """CPU time (in microseconds) and peak memory (in bytes) of a leaf"""
+    if path is None: return {}
+    ret = {}
+    try:
+      for line in self._read(path, 'cpu.stat').split('\n'):
+        if line.startswith('usage_usec '):
+          ret['cpu_usec'] = int(line.split()[1])
+      ret['memory_peak'] = int(self._read(path, 'memory.peak'))
+    except (IOError, OSError, ValueError): pass
+    return ret
+
+  def kill(self, path):
+    if path is not None:
+      try:
+        self._write(path, 'cgroup.kill', 1)
+      except (IOError, OSError): pass
+
+  def populated(self, path):
+    """Whether a leaf still holds processes"""
+    try:
+      with file(os.path.join(path, 'cgroup.events')) as f:
+        return 'populated 1' in f.read()
+    except IOError:
+      return False
+
+  def collect(self, path):
+    """Final usage of a leaf, removed once empty (see sweep())"""
+    if path is None: return {}
+    ret = self.usage(path)
+    self.stale.append(path)
+    return ret
+
+  def sweep(self):
+    """Remove the leaves no longer needed, unless still populated"""
+    for path in self.stale[:]:
+      try:
+        os.rmdir(path)
+      except OSError, e:
+        if e.errno != errno.ENOENT: continue
+      self.stale.remove(path)
+
+_cgroups = Cgroups()
+
+#-------------------------------------------------------------------------------
+class Budget:
+  """
+  CPU budget shared by the hacks of the whole daemon, in cores (None
+  meaning unlimited): the cost of each hack is estimated live from
+  what its runs use, as a moving average of its CPU share, for hacks
+  rotations to fit within the budget (see XScreenSaverEvent.pick()).
+  Children only count once they have a `hack' name: they are sampled
+  from their start (see seed()), then every `period' seconds by the
+  daemon loop (see next_deadline()), and a last time on exit.
+  """
+  default = .5	# Estimated share of a hack never measured nor benchmarked
+  period  = 1.	# Shortest sampling period of a running hack
+
+  def __init__(self, limit=None):
+    self.limit = limit
+    self.costs = {}				# Hack => CPU share
+    self.ticks = float(os.sysconf('SC_CLK_TCK'))
+    self.due   = 0.				# Next sampling time
+
+  def _update(self, hack, share):
+    old = self.costs.get(hack)
+    self.costs[hack] = share if old is None else (old + share) / 2.
+
+  def cputime(self, child):
+    """CPU seconds used by a running child, group included if in a cgroup"""
+    usage = _cgroups.usage(child.cgroup)
+    if usage.has_key('cpu_usec'):
+      return usage['cpu_usec'] / 1e6
+    try:
+      with file('/proc/%d/stat' % child.pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+      return (int(fields[11]) + int(fields[12])) / self.ticks
+    except (IOError, IndexError, ValueError):
+      return None
+
+  def seed(self, child):
+    """Take the first sample of a child just started"""
+    cpu = self.cputime(child)
+    if cpu is not None: child.sampled = (time.time(), cpu)
+
+  def next_deadline(self):
+    """Time by which sample() needs to be called, if any"""
+    if self.limit is None: return None
+    if [child for child in _supervisor.children.values()
+        if child.hack is not None]:
+      return self.due
+    return None
+
+  def sample(self):
+    """Update the estimates from the running children"""
+    now = time.time()
+    self.due = now + self.period
+    for child in _supervisor.children.values():
+      if child.hack is None: continue
+      cpu = self.cputime(child)
+      if cpu is None: continue
+      last = getattr(child, 'sampled', None)
+      if _supervisor.stopped(child):
+        child.sampled = None
+      elif last is None or last[0] < child.resumed:
+        child.sampled = (now, cpu)
+      elif now - last[0] >= self.period:
+        self._update(child.hack, (cpu - last[1]) / (now - last[0]))
+        child.sampled = (now, cpu)
+
+  def account(self, child):
+    """Final estimate update from an exited child resource usage"""
+    last = getattr(child, 'sampled', None)
+    if (child.hack is None or child.rusage is None or last is None or
+        last[0] < child.resumed or _supervisor.stopped(child)): return
+    elapsed = time.time() - last[0]
+    # The cgroup, if any, is still there to be read
+    cpu = (self.cputime(child) if child.cgroup is not None else
+           child.rusage.ru_utime + child.rusage.ru_stime)
+    if elapsed >= self.period and cpu is not None:
+      self._update(child.hack, (cpu - last[1]) / elapsed)
+
+  def estimate(self, hack, costs={}):
+    """CPU share of a hack: measured, else benchmarked, else the default"""
+    if self.costs.has_key(hack):
+      return self.costs[hack]
+    return costs.get(hack, {}).get('cpu', self.default)
+
+  def load(self, exclude=[], costs={}):
+    """Estimated CPU share of the running hacks, but `exclude' children"""
+    return sum([self.estimate(child.hack, costs)
+                for child in _supervisor.children.values()
+                if child.hack is not None and not child._killflag and
+                not child in exclude])
+
+_budget = Budget()
+
+#-------------------------------------------------------------------------------
+class Reactor:
+  """
+  Daemon loop core: file descriptors are registered along with their
+  handler, called with the descriptor and the ready events once
+  poll() finds them ready. It is built on epoll, or poll where not
+  available.
+  """
+  IN  = select.POLLIN
+  OUT = select.POLLOUT
+  PRI = select.POLLPRI
+
+  def __init__(self):
+    self.handlers = {}
+    if hasattr(select, 'epoll'):
+      self.poller = select.epoll()
+      self.scale  = 1.
+    else:
+      self.poller = select.poll()
+      self.scale  = 1000.
+
+  def register(self, fd, events, handler):
+    self.poller.register(fd, events)
+    self.handlers[fd] = handler
+
+  def modify(self, fd, events):
+    self.poller.modify(fd, events)
+
+  def unregister(self, fd):
+    self.poller.unregister(fd)
+    del self.handlers[fd]
+
+  def poll(self, timeout=None):
+    """Wait up to `timeout' seconds (None meaning forever), then dispatch"""
+    try:
+      ready = self.poller.poll(-1 if timeout is None else
+                               timeout * self.scale)
+    except (IOError, select.error), e:
+      if e[0] != errno.EINTR: raise
+      ready = []
+    for fd, events in ready:
+      if self.handlers.has_key(fd):
+        self.handlers[fd](fd, events)
+
+class Watcher:
+  """
+  Call back on files changes, as a Reactor handler: their directories
+  are watched rather than the files themselves, so that files replaced
+  by renaming (as many editors do) are still followed. It does nothing
+  where inotify is not available (see fileno()).
+  """
+  def __init__(self):
+    self.fd    = pysaver.inotify() if hasattr(pysaver, 'inotify') else None
+    self.dirs  = {}				# wd => directory
+    self.files = {}				# path => callback
+
+  def fileno(self):
+    return self.fd
+
+  def watch(self, path, callback):
+    path = os.path.abspath(path)
+    if self.fd is not None and not os.path.dirname(path) in self.dirs.values():
+      self.dirs[pysaver.watch(self.fd, os.path.dirname(path))] = \
+        os.path.dirname(path)
+    self.files[path] = callback
+
+  def __call__(self, fd, events):
+    # Several changes to a same file usually come together
+    changed = set([os.path.join(self.dirs[wd], name)
+                   for wd, name in pysaver.changes(self.fd)
+                   if self.dirs.has_key(wd)])
+    for path in changed.intersection(self.files):
+      self.files[path]()
+
+class Pressure:
+  """
+  Throttle the hacks on system pressure, as a Reactor handler: Linux
+  pressure stall information triggers fire once some tasks stalled on
+  a watched resource for more than its threshold share of the time,
+  and the hacks are then either stopped (see Supervisor.pause()) or,
+  for the 'blank' action, traded for blank panes (see
+  Events.throttle()), until no trigger fired for `hold' seconds.
+  """
+  window = 2.	# Triggers window: unprivileged ones need multiples of 2s
+  hold   = 6.	# Seconds without any stall before the hacks get back
+
+  def __init__(self):
+    self.fds     = {}				# fd => resource
+    self.blank   = False
+    self.until   = None				# Throttled until then
+    self.reactor = None
+    self.servers = []
+
+  def setup(self, thresholds=None, action='stop'):
+    """
+    Arm triggers from {resource: share}, where resources are those of
+    /proc/pressure ('cpu', 'memory' or 'io'), dropping the old ones
+    """
+    self.close()
+    self.blank = action == 'blank'
+    for resource, share in sorted((thresholds or {}).items()):
+      path = '/proc/pressure/%s' % resource
+      try:
+        fd = os.open(path, os.O_RDWR | os.O_NONBLOCK)
+        try:
+          # The kernel takes the last byte written for a terminator
+          os.write(fd, 'some %d %d\0' % (share * self.window * 1e6,
+                                         self.window * 1e6))
+        except OSError:
+          os.close(fd)
+          raise
+      except OSError, e:
+        logging.warning('No pressure trigger on %s: %s' % (path, e))
+        continue
+      self.fds[fd] = resource
+      if self.reactor is not None:
+        self.reactor.register(fd, Reactor.PRI, self)
+
+  def attach(self, reactor, servers):
+    self.reactor, self.servers = reactor, servers
+    for fd in self.fds: reactor.register(fd, Reactor.PRI, self)
+
+  def close(self):
+    if self.until is not None: self.expire(self.until)
+    for fd in self.fds.keys(): self.drop(fd)
+
+  def drop(self, fd):
+    if self.reactor is not None: self.reactor.unregister(fd)
+    os.close(fd)
+    del self.fds[fd]
+
+  def __call__(self, fd, events):
+    if not events & Reactor.PRI:
+      logging.warning('Pressure trigger on %s lost' % self.fds[fd])
+      self.drop(fd)
+      return
+    throttled = self.until is not None
+    self.until = time.time() + self.hold
+    if not throttled:
+      logging.info('Stalls on %s: throttling the hacks' % self.fds[fd])
+      self.throttle(True)
+
+  def blanked(self):
+    """Whether the hacks should give way to blank panes"""
+    return self.blank and self.until is not None
+
+  def throttle(self, on):
+    if self.blank:
+      for server in self.servers:
+        server.events.throttle(on)
+        server.pending = True
+    elif on:
+      _supervisor.pause('pressure')
+    else:
+      _supervisor.resume('pressure')
+
+  def next_deadline(self):
+    return self.until
+
+  def expire(self, now=None):
+    """Bring the hacks back if the pressure is over"""
+    if now is None: now = time.time()
+    if self.until is not None and now >= self.until:
+      logging.info('No more stalls: resuming the hacks')
+      self.until = None
+      self.throttle(False)
+
+_pressure = Pressure()
+
 #-------------------------------------------------------------------------------
 class XLameSaverPrefs(dict):
   """xlamesaver preference file as a dictionary"""
   def __init__(self, path = '%(HOME)s/.xlamesaver', **kw):
     try:
       path = path % os.environ
+      self.path, self.forced = path, kw
   
       # Create configuration file if it does not exist
       if not os.path.isfile(path):
@@ -173,6 +722,62 @@ class XLameSaverPrefs(dict):
           #
           hysteresis = 10
 
+          # Use the server own idle time (XSync IDLETIME counter)
+          # when available, so that no keypress goes unnoticed
+          # between two polls, and thresholds are signaled by
+          # server-side alarms
+          #
+          idletime = True
+
+          # Capture all input through the RECORD extension, when
+          # pysaver was built with it: activity is then credited
+          # to the right screens whatever the polling rate, and
+          # despite any grab
+          #
+          # record = True
+
+          # Only create the panes on screens when first blanked,
+          # and release them after that many seconds without being
+          # used, to spare the server memory (None keeps them all
+          # around, for the whole life of the daemon)
+          #
+          # release = 3600
+
+          # Run each hack in a cgroup v2 leaf of its own, so that
+          # events can limit their resources (see their `limits'),
+          # and what they used gets reported: True uses the daemon
+          # own cgroup, that must then be delegated to the user, or
+          # give the path of a delegated cgroup directory
+          #
+          # cgroup = True
+
+          # Keep the hacks of all the screens within that many
+          # cores, as measured while they run: hacks rotations
+          # skip the ones that would not fit
+          #
+          # cpu_budget = 2.
+
+          # Throttle the hacks while other tasks stall on the
+          # system resources more than these shares of the time
+          # (Linux pressure stall information), stopping them or,
+          # with the 'blank' action, showing blank panes instead
+          #
+          # pressure = {'cpu': .2, 'memory': .1}
+          # pressure_action = 'stop'
+
+          # Create one pane per monitor instead of one per X
+          # screen, when pysaver was built with RandR support:
+          # screen numbers used by events then refer to these
+          # panes
+          #
+          # outputs = True
+
+          # Additional displays to manage from this same daemon,
+          # with their own events (None meaning a copy of `events'
+          # below): each display gets its own command socket
+          #
+          # displays = { ':1.0': None }
+
           # Mode at startup time
           #
           mode = "default"
@@ -195,7 +800,11 @@ class XLameSaverPrefs(dict):
         
       # And make sure some defaults are set
       for k, v in (('display', ''), ('visuals', {}), ('hysteresis', 10),
-                   ('nice', 5), ('mode', 'default'), ('events', [])):
+                   ('idletime', True), ('outputs', False),
+                   ('record', False), ('release', None), ('nice', 5),
+                   ('cgroup', None), ('cpu_budget', None),
+                   ('pressure', None), ('pressure_action', 'stop'),
+                   ('mode', 'default'), ('events', []), ('displays', {})):
         if not self.has_key(k):
           self[k] = v
           
@@ -203,19 +812,51 @@ class XLameSaverPrefs(dict):
       logging.error('Could not load preferences file')
       raise
 
+  def reload(self):
+    """Load the same preferences file anew, as a new instance"""
+    return XLameSaverPrefs(self.path, **self.forced)
+
 #-------------------------------------------------------------------------------
-class XScreenSaverPrefs(dict):
+class CachedFile:
+  """
+  Mixin sharing instances loaded from files: each class using it needs
+  a `_cache' dictionary of its own, and a constructor taking the path
+  """
+  @classmethod
+  def cached(cls, path):
+    """
+    Shared instance for a given file, only loaded again once the file
+    changed (by modification time and size). A missing file raises
+    OSError, but is still watched for, through paths()
+    """
+    path  = path % os.environ
+    obj   = cls._cache.setdefault(path, None)
+    st    = os.stat(path)
+    stamp = (st.st_mtime, st.st_size)
+    if obj is None or obj.stamp != stamp:
+      obj = cls._cache[path] = cls(path)
+      obj.stamp = stamp
+    return obj
+
+  @classmethod
+  def paths(cls):
+    """Files asked for through cached() so far, existing or not"""
+    return cls._cache.keys()
+
+class XScreenSaverPrefs(dict, CachedFile):
   """XScreenSaver preference file as a dictionary"""
+  keyvals = re.compile('^(\w+):\s*(.*)$')
+  empty   = re.compile('^\s*$')
+  hack    = re.compile('^(-?)\s*(\w+:)?\s*("[^"]*")?(.*)$')
+  time    = re.compile('^\d+:\d+:\d+$')
+  number  = re.compile('^-?\d+$')
+  true    = re.compile('^True$', re.IGNORECASE)
+  false   = re.compile('^False$', re.IGNORECASE)
+
+  _cache  = {}	# Path => instance shared through cached()
   
   def __init__(self, path = '%(HOME)s/.xscreensaver'):
     dict.__init__(self)
-    self.keyvals = re.compile('^(\w+):\s*(.*)$')
-    self.empty   = re.compile('^\s*$')
-    self.hack    = re.compile('^(-?)\s*(\w+:)?\s*("[^"]*")?(.*)$')
-    self.time    = re.compile('^\d+:\d+:\d+$')
-    self.number  = re.compile('^-?\d+$')
-    self.true    = re.compile('^True$', re.IGNORECASE)
-    self.false   = re.compile('^False$', re.IGNORECASE)
     self.load(path)
 
   def load(self, path = '%(HOME)s/.xscreensaver'):
@@ -274,6 +915,42 @@ class XScreenSaverPrefs(dict):
       yield line
 
 #-------------------------------------------------------------------------------
+class HackCosts(dict, CachedFile):
+  """
+  Hacks costs database as a dictionary, as measured by benchmark(): it
+  maps hack names to {'cpu': share of a core, 'rss': peak resident
+  size in kB, 'fps': frames per second (None if unknown)}. The file
+  holds it as a Python literal; a missing one is an empty database.
+  """
+  _cache = {}	# Path => instance shared through cached()
+
+  def __init__(self, path = '%(HOME)s/.xlamesaver.costs'):
+    dict.__init__(self)
+    self.load(path)
+
+  def load(self, path = '%(HOME)s/.xlamesaver.costs'):
+    """Reload the costs from file"""
+    self.clear()
+    if os.path.isfile(path % os.environ):
+      with file(path % os.environ) as f:
+        self.update(ast.literal_eval(f.read()))
+
+  def save(self, path = '%(HOME)s/.xlamesaver.costs'):
+    with file(path % os.environ, 'w') as f:
+      f.write('# Hacks costs, as measured by xlamesaver --benchmark\n' +
+              pprint.pformat(dict(self)) + '\n')
+
+#-------------------------------------------------------------------------------
+def _signature(value):
+  """Comparable form of events parameters, nested events included"""
+  if isinstance(value, Event):
+    return value.signature()
+  elif isinstance(value, dict):
+    return sorted([(k, _signature(v)) for k, v in value.iteritems()])
+  elif isinstance(value, (list, tuple)):
+    return [_signature(v) for v in value]
+  return value
+
 class Event:
   """Base event class
 
@@ -282,6 +959,7 @@ class Event:
   """
 
   display = None	# Display name: set in Events manager
+  xdpy    = pysaver	# Display connection: set in Events manager
   
   def __init__(self, screens=None, time=60, modes=['default'],
                dbglabel=None, **kw):
@@ -291,6 +969,8 @@ class Event:
     used to generate more expressive object representation when
     debugging
     """
+    self._args       = dict(kw, screens=screens, time=time, modes=modes,
+                            dbglabel=dbglabel)
     self._state      = 0
     self._allscreens = screens is None
     self._next_tic   = 0
@@ -324,7 +1004,8 @@ class Event:
 
   def display_name(self, screen):
     """Mangle display name to specify new default screen"""
-    return '.'.join(self.display.split('.')[:-1] + ['%d' % screen])
+    return '.'.join(self.display.split('.')[:-1] +
+                    ['%d' % self.xdpy.geometry(screen)[0]])
   
   def refresh(self, srange=[]):
     """
@@ -340,9 +1021,17 @@ class Event:
     self.srange = srange
     if self._allscreens:
       self.screens = srange
+    self.mask = sum([1 << screen for screen in set(self.screens)])
     
   def running(self):
     return bool(self._state % 2)
+
+  def signature(self):
+    """
+    What this event was built from: events of equal signatures would
+    behave the same (see Events.reload())
+    """
+    return (self.__class__.__name__, _signature(self._args))
     
   def match(self, activity, mode):
     """Check if state switch is needed
@@ -414,85 +1103,289 @@ class Event:
     """Tic event"""
     pass
 
+  def throttle(self, on):
+    """
+    Resources are scarce (or no longer are, if not `on'): return True
+    to be restarted, the events manager then toggling the event off
+    and on again
+    """
+    return False
+
+  def hide(self, screens):
+    """What is shown on `screens' cannot be seen, until told otherwise"""
+    pass
+
 #-------------------------------------------------------------------------------
 class BlankEvent(Event):
   """
   Blank screens event
 
-  Blank one or many screens
+  Blank one or many screens: if `fade' is given, screens darken from
+  their current content to black over that many seconds first (see
+  pysaver's fade()), unless the display does not support it.
   """
+  def config(self, fade=0):
+    self.fade = fade
+
   def start(self):
     for screen in self.screens:
-      pysaver.activate(screen)
+      if self.fade:
+        try:
+          self.xdpy.fade(screen, self.fade)
+        except RuntimeError, e:
+          logging.debug(str(e))
+      self.xdpy.activate(screen)
 
   def stop(self):
     for screen in self.screens:
-      pysaver.desactivate(screen)
+      self.xdpy.desactivate(screen)
+
+#-------------------------------------------------------------------------------
+class DPMSEvent(BlankEvent):
+  """
+  Blank screens, then power down the monitors
+
+  Monitors are put to the power levels listed in `stages' in turn
+  ('standby', 'suspend' or 'off'), waiting `delay' seconds between
+  each, and powered back on when the event stops. DPMS power levels
+  apply to the whole display: this event should normally cover all
+  the screens, as it does by default, and be the most senior one on
+  them... Here is an example:
+
+  events = [ BlankEvent(time=60, screens=[1]),
+             DPMSEvent(time=600, stages=['standby', 'off'], delay=300) ]
+  """
+  def config(self, stages=['off'], delay=60, fade=0):
+    BlankEvent.config(self, fade)
+    for level in stages:
+      if not level in ('standby', 'suspend', 'off'):
+        raise RuntimeError('unknown power level "%s"' % level)
+    self.stages = stages
+    self.delay  = delay
+    self.stage  = 0
+
+  def start(self):
+    BlankEvent.start(self)
+    self.stage = 0
+
+  def stop(self):
+    BlankEvent.stop(self)
+    try:
+      self.xdpy.dpms('on')
+    except RuntimeError, e:
+      logging.warning(str(e))
+
+  def tic(self):
+    if self.stage < len(self.stages):
+      try:
+        self.xdpy.dpms(self.stages[self.stage])
+      except RuntimeError, e:
+        logging.warning(str(e))
+        return None
+      self.stage += 1
+      return self.delay if self.stage < len(self.stages) else None
+
+#-------------------------------------------------------------------------------
+class SurfaceEvent(BlankEvent):
+  """
+  Base class for in-process screensavers
+
+  Instead of spawning external processes, this event draws right into
+  an image shared with the X server on each of its screens (see
+  pysaver's surface()), from its draw() method: it is called on start,
+  then every `cycle' seconds, with the screen number, a writable
+  buffer over the image and the image geometry, and should return the
+  list of (x, y, width, height) rectangles it changed, None meaning
+  the whole image. Here is a trivial example, for 32 bpp visuals:
+
+  class GrayEvent(SurfaceEvent):
+    def draw(self, screen, buf, width, height, bytes_per_line, bpp):
+      buf[:] = chr(int(time.time()) % 256) * len(buf)
+  """
+  def config(self, cycle=1):
+    BlankEvent.config(self)
+    self.cycle = cycle
+
+  def tic(self):
+    try:
+      for screen in self.screens:
+        self.xdpy.present(screen,
+                          self.draw(screen, *self.xdpy.surface(screen)))
+    except RuntimeError, e:
+      logging.warning(str(e))
+      return None
+    return self.cycle
+
+  def draw(self, screen, buf, width, height, bytes_per_line, bpp):
+    """Draw on screen, returning the changed rectangles"""
+    raise RuntimeError('%s is virtual' % self.__class__)
 
 #-------------------------------------------------------------------------------
 class ExternalProcessEvent(Event):
   """Base class for events managing an external process"""
   
   class Child(subprocess.Popen):
-    """Single process manager with integrated zombie collection"""
-    def __init__(self, cmd):
+    """
+    Single process manager with integrated zombie collection: each
+    child leads its own process group, killed as a whole (see
+    Supervisor)
+    """
+    grace = 2.	# Seconds given to quit before getting killed for good
+    hack  = None	# Name, for its costs to be accounted for (see Budget)
+    resumed = 0.	# Last time it was continued, if ever stopped
+
+    def __init__(self, cmd, limits=None):
       self._killflag = False
+      self.holds = set()			# Reasons to keep it stopped
+      self.command = cmd if isinstance(cmd, str) else ' '.join(cmd)
+      self.status = self.rusage = None
+      self.cgroup = _cgroups.leaf(limits)
       self._install_childhdlr()
-      subprocess.Popen.__init__(self,
-                                cmd.split() if isinstance(cmd, str) else cmd)
+      _protect(self._spawn, cmd.split() if isinstance(cmd, str) else cmd)
+
+    def _spawn(self, args):
+      try:
+        subprocess.Popen.__init__(self, args, preexec_fn=self._preexec)
+      except:
+        _cgroups.collect(self.cgroup)
+        raise
+      _supervisor.add(self)
+
+    def _preexec(self):
+      os.setpgid(0, 0)
+      _cgroups.join(self.cgroup)
+      # Children should not inherit SIGCHLD blocked
+      pysaver.unblock()
 
     def _install_childhdlr(self):
-      if (signal.getsignal(signal.SIGCHLD) in
+      if (_protect.sigfd is None and
+          signal.getsignal(signal.SIGCHLD) in
           (signal.SIG_IGN, signal.SIG_DFL, None)):
         signal.signal(signal.SIGCHLD, self._childhdlr)
 
     def _childhdlr(self, signum, frame):
-      try:
-        _protect(os.waitpid, 0, os.WNOHANG)
-      except OSError: pass
+      _protect(_supervisor.reap)
       self._install_childhdlr()
 
+    def exited(self, status, rusage):
+      """Called by the Supervisor once the child was collected"""
+      self.status, self.rusage = status, rusage
+      self._handle_exitstatus(status)
+
+    def poll(self):
+      # Reaping belongs to the Supervisor, for it to get resource usage
+      _protect(_supervisor.reap)
+      return self.returncode
+
     def kill(self): _protect(self._kill)
     
     def _kill(self):
-      if self.poll() is None:
-        try:
-          os.kill(self.pid,
-                  signal.SIGKILL if self._killflag else signal.SIGQUIT)
-        except OSError: pass
+      if not self._killflag:
+        _supervisor.terminate(self, self.grace)
       self._killflag = True
     
-  def config(self, cycle=None, activate=True):
+  def config(self, cycle=None, activate=True, standby=None, limits=None):
     self.cycle    = cycle
     self.activate = activate
+    self.standby  = standby
+    self.limits   = limits
     self.win      = {}
     self.children = {}
+    self.pending  = {}
+    self.hidden   = set()
 
   def kill_child(self, screen):
     if self.children.has_key(screen): self.children[screen].kill()
+    if self.pending.has_key(screen): self.pending.pop(screen).kill()
 
   def start(self):
+    self.children.clear()
     if self.activate:
       for screen in self.screens:
-        self.win[screen] = pysaver.activate(screen, self.kill_child,
-                                            screen=screen)
+        self.win[screen] = self.xdpy.activate(screen, self.kill_child,
+                                              screen=screen)
 
   def stop(self):
     for screen in self.screens:
-      if self.activate: pysaver.desactivate(screen)
+      if self.activate: self.xdpy.desactivate(screen)
       self.kill_child(screen)
+
+  def hide(self, screens):
+    """
+    Stop the commands while their output cannot be seen, continuing
+    them once it can again: only the ones drawing into panes are, the
+    output of others being unknown
+    """
+    if not self.activate: return
+    self.hidden = set(screens)
+    for screen in self.screens:
+      for child in (self.children.get(screen), self.pending.get(screen)):
+        if child is None: continue
+        if screen in self.hidden:
+          _supervisor.hold(child, 'hidden')
+        else:
+          _supervisor.release(child, 'hidden')
+
+  def throttle(self, on):
+    """
+    Trade the commands for blank panes while resources are scarce,
+    running them again right after (see Pressure): commands without
+    panes have nothing to be traded for, and are left alone
+    """
+    if not self.activate: return False
+    if not on: self._next_tic = 0
+    return on
+
+  def spawn(self, screen, window):
+    """Run the next command on screen, drawing into window"""
+    os.environ['DISPLAY'] = self.display_name(screen)
+    child = self.Child(self.cmd(screen) % {'window': window,
+                                           'screen': screen}, self.limits)
+    if screen in self.hidden: _supervisor.hold(child, 'hidden')
+    return child
     
   def tic(self):
+    if self.activate and _pressure.blanked():
+      return self.cycle
+    if self.standby is not None and self.activate and self.children:
+      return self.warm_cycle()
     for screen in self.screens:
       self.kill_child(screen)
-      os.environ['DISPLAY'] = self.display_name(screen)
-      self.children[screen] = self.Child(
-        self.cmd(screen) % {'window':
-                            self.win[screen]
-                            if self.win.has_key(screen) else 0,
-                            'screen': screen})
+      self.children[screen] = self.spawn(screen, self.window(screen))
     return self.cycle
 
+  def window(self, screen):
+    """
+    Window to run a command into from scratch: for warm cycles, it is
+    a child of the pane, for the next command to warm up out of sight
+    beneath it rather than over the pane (see warm_cycle())
+    """
+    if self.standby is not None and self.activate:
+      self.xdpy.standby(screen)
+      return self.xdpy.swap(screen)
+    return self.win.get(screen, 0)
+
+  def warm_cycle(self):
+    """
+    Cycle without showing the next commands before they drew anything:
+    they are started on standby windows while the current ones keep
+    running, and swapped in once ready, `standby' seconds at most
+    (see pysaver standby()).
+    """
+    now = time.time()
+    if not self.pending:
+      for screen in self.screens:
+        self.pending[screen] = self.spawn(screen, self.xdpy.standby(screen))
+      self.launched = now
+    for screen in self.pending.keys():
+      if (self.xdpy.ready(screen) or now - self.launched >= self.standby or
+          self.pending[screen].poll() is not None):
+        self.xdpy.swap(screen)
+        self.children[screen].kill()
+        self.children[screen] = self.pending.pop(screen)
+    # The cycle is counted from the last swap
+    return .05 if self.pending else self.cycle
+
   def cmd(self, screen):
     """Returns the complete command to run on screen, as a string"""
     raise RuntimeError('%s is virtual' % self.__class__)
@@ -503,20 +1396,33 @@ class ScriptEvent(ExternalProcessEvent):
   Call arbitrary program using command line specified by `command'.
 
   The called command can either be long running or not, its your call:
-  it will be killed as appropriate on stop or on cycling, but it is
-  your duty to kill other child process you spawned yourself. Do not
-  hesitate to reuse ExternalProcessEvent.Child, as it comes with an
-  integrated SIGCHLD handler and correct sigblock, not available from
-  any stock Python module.
+  it will be killed as appropriate on stop or on cycling, along with
+  its whole process group (SIGQUIT first, then SIGKILL after a grace
+  period), but it is your duty to kill other child process you spawned
+  yourself in a group of their own. Do not hesitate to reuse
+  ExternalProcessEvent.Child, as it comes with integrated zombie
+  collection and correct sigblock, not available from any stock Python
+  module.
 
   Please note that a simple interpolation mechanism exists for you to
   reuse: you can use '0x%(window)x' and '%(screen)d' in the string
   returned by self.cmd() if you want to substitute activated window id
   (hexadecimal) and screen number respectively in the final command
   line.
+
+  When cycling an activated window, setting 'standby' to some delay in
+  seconds starts the next command ahead, out of sight, and only shows
+  it once it drew something, or after that delay at most: the
+  previous one keeps running until then.
+
+  When the daemon runs its children in cgroups (see the 'cgroup'
+  preference), 'limits' sets the cgroup v2 interface files of each
+  command leaf, such as {'cpu.max': '50000 100000', 'memory.max':
+  '256M', 'pids.max': 32}.
   """
-  def config(self, cycle=None, activate=True, command=None):
-    ExternalProcessEvent.config(self, cycle, activate)
+  def config(self, cycle=None, activate=True, command=None, standby=None,
+             limits=None):
+    ExternalProcessEvent.config(self, cycle, activate, standby, limits)
     self.command = command
     if command is None:
       raise TypeError('command parameter unspecified in %s' % self.__class__)
@@ -551,21 +1457,50 @@ class XScreenSaverEvent(ExternalProcessEvent):
   'activity' (a list of valid boolean states), 'names' (a list of
   hacks names), and 'exclude' (a list of hacks names).
 
+  Hacks can also be selected on their costs, as measured by
+  `xlamesaver --benchmark' into the 'costs' file: 'max_cpu' (the
+  share of a core), 'max_rss' (in kB) and 'min_fps' filter them out,
+  while 'weight' (a function of a hack costs dictionary, see
+  HackCosts) makes the hacks it returns higher values for come up
+  more often first. Hacks never measured are neither filtered nor
+  weighted:
+
+  hacks_criteria = {0: {'max_cpu': .5, 'min_fps': 20,
+                        'weight': lambda cost: 1. / (cost['cpu'] + .05)}}
+
   Other events parameter are 'cycle' (the delay in seconds before
   switching hacks), 'hacks_path' (the path name to the xcreensaver
   hacks), 'xscreensaver_config' (the path to the XScreenSaver
   preferences file to use), and 'sync' (if True, the same hacks will
   be run on all the screens the event is run on: it is the same than
   the random-same mode from XScreenSaver).
+
+  Finally, 'standby' (a delay in seconds, None by default) has the next
+  hack started ahead on cycling, while the current one keeps running:
+  it is only shown once it drew its first frame, or after that delay
+  at most, so that slow starting hacks (GL ones, typically) never leave
+  a black screen between them, and 'limits' sets the resources each hack
+  is given (see ScriptEvent).
+
+  When the daemon is given a CPU budget (see the 'cpu_budget'
+  preference), each hack rotation skips the hacks that would not fit
+  in it alongside the ones already running on all screens, as their
+  costs are measured (or benchmarked, for the ones never run).
   """
   def config(self, cycle=None,
              hacks_path = '/usr/lib/misc/xscreensaver',
              xscreensaver_config = '%(HOME)s/.xscreensaver', 
              hacks_criteria = {},
-             sync = False):
-    ExternalProcessEvent.config(self, cycle, activate=True)
+             sync = False,
+             standby = None,
+             limits = None,
+             costs = '%(HOME)s/.xlamesaver.costs'):
+    ExternalProcessEvent.config(self, cycle, activate=True, standby=standby,
+                                limits=limits)
   
-    self.xconf  = XScreenSaverPrefs(xscreensaver_config)
+    self.xpath  = xscreensaver_config
+    self.xconf  = XScreenSaverPrefs.cached(xscreensaver_config)
+    self.cpath  = costs
     self.crits  = hacks_criteria
     self.path   = hacks_path
     self.sync   = sync
@@ -576,15 +1511,38 @@ class XScreenSaverEvent(ExternalProcessEvent):
     def crit(screen):
       return self.crits[screen] if self.crits.has_key(screen) else {}
     
-    def iterhacks(activity = [True], visuals=[], names=[], exclude=[]):
+    def iterhacks(activity = [True], visuals=[], names=[], exclude=[],
+                  max_cpu=None, max_rss=None, min_fps=None, weight=None):
+      def within(k, key, limit, below=True):
+        cost = self.costs.get(k, {}).get(key)
+        return (limit is None or cost is None or
+                (cost <= limit if below else cost >= limit))
       for k, v in self.xconf['programs'].iteritems():
         if ((v['active'] in activity) and
             (len(visuals)==0 or v['visual'] in visuals) and
             (not k in exclude) and 
-            (len(names)==0 or (k in names))):
+            (len(names)==0 or (k in names)) and
+            within(k, 'cpu', max_cpu) and within(k, 'rss', max_rss) and
+            within(k, 'fps', min_fps, False)):
           yield k
+
+    def shuffle(hacks, screen):
+      weight = crit(screen).get('weight')
+      if weight is None:
+        random.shuffle(hacks)
+      else:
+        # Weighted random order: each hack keys on u ** (1 / weight)
+        def key(k):
+          w = weight(self.costs[k]) if self.costs.has_key(k) else 1.
+          return random.random() ** (1. / max(w, 1e-9))
+        hacks.sort(key=key, reverse=True)
     
     Event.refresh(self, srange)
+    self.xconf = XScreenSaverPrefs.cached(self.xpath)
+    try:
+      self.costs = HackCosts.cached(self.cpath)
+    except (IOError, OSError):
+      self.costs = {}
 
     # List the hacks to use
     #
@@ -593,6 +1551,7 @@ class XScreenSaverEvent(ExternalProcessEvent):
 
     # Check common hacks, as needed
     if self.sync:
+      self.common = None
       for h in self.hacks.itervalues():
         if self.common is None:
           self.common = set(h)
@@ -608,24 +1567,52 @@ class XScreenSaverEvent(ExternalProcessEvent):
       for screen in self.screens:
         if len(self.hacks[screen])==0:
           raise RuntimeError('no suitable hack found for screen %d' % screen)
-        random.shuffle(self.hacks[screen])
+        shuffle(self.hacks[screen], screen)
         self.cur[screen] = 0
     else:
-      random.shuffle(self.common)
+      shuffle(self.common, self.screens[0])
       self.cur = 0
 
+  def pick(self, hacks, cur, screens):
+    """
+    Position in the rotation, from `cur' on, of the first hack fitting
+    within the daemon CPU budget (see Budget) once run on `screens' in
+    place of what this event runs there, or else of the cheapest one:
+    hacks measured as too expensive are thus swapped out on next cycle.
+    """
+    if _budget.limit is None: return cur
+    _budget.sample()
+    load = _budget.load([self.children[screen] for screen in screens
+                         if self.children.has_key(screen)], self.costs)
+    costs = [(_budget.estimate(hacks[(cur + i) % len(hacks)], self.costs) *
+              len(screens), i) for i in xrange(len(hacks))]
+    for cost, i in costs:
+      if load + cost <= _budget.limit: return cur + i
+    return cur + min(costs)[1]
+
   def cmd(self, screen):
     def index(t, i): return t[i % len(t)]
     if self.sync:
+      if screen == self.screens[0]:
+        self.cur = self.pick(self.common, self.cur, self.screens)
       hack = index(self.common, self.cur)
       if screen == self.screens[-1]: self.cur += 1
     else:
+      self.cur[screen] = self.pick(self.hacks[screen], self.cur[screen],
+                                   [screen])
       hack = index(self.hacks[screen], self.cur[screen])
       self.cur[screen] += 1
       
     logging.info('Running hack "%s" on screen %d' % (hack, screen))
+    self.hack = hack
     return os.path.join(self.path, self.xconf['programs'][hack]['cmd']) + \
            ' -window-id 0x%(window)x'
+
+  def spawn(self, screen, window):
+    child = ExternalProcessEvent.spawn(self, screen, window)
+    child.hack = self.hack
+    _budget.seed(child)
+    return child
     
 #-------------------------------------------------------------------------------
 class CompoundEvent(Event, list):
@@ -676,6 +1663,8 @@ class CompoundEvent(Event, list):
     try:
       # Check for compound events
       for evt in self:
+        evt.display = self.display
+        evt.xdpy    = self.xdpy
         evt.refresh(self.screens)
         evt.time  = None
         evt.modes = None
@@ -707,6 +1696,18 @@ class CompoundEvent(Event, list):
     except ValueError:
       return None
 
+  def throttle(self, on):
+    for evt in self:
+      if evt.running() and evt.throttle(on):
+        evt.toggle()
+        evt.toggle()
+    if self._next_tic is not None: self._next_tic = 0
+    return False
+
+  def hide(self, screens):
+    for evt in self:
+      if evt.running(): evt.hide(screens)
+
 #-------------------------------------------------------------------------------
 class ManagerEvent(Event):
   """
@@ -760,28 +1761,76 @@ class StateChangeEvent(ManagerEvent):
 class Events(list):
   """
   That's the event manager: it fires up and down events based on screens
-  activity.
+  activity. Running events are also told which screens cannot be seen
+  (see Event.hide()): those of fully obscured panes, or all of them
+  while the monitors are powered down, as checked every `dpms_period'
+  seconds.
+
+  Transitions are told to `listeners' as they happen, as a topic and
+  its details (see notify()): 'activity', for screens seeing input
+  after `quiet' seconds without any, 'modes', when the current mode
+  changes, and 'events', when events start or stop.
   """
+  dpms_period = 5.
+  quiet       = 1.
+
   class States(list):
     """Low level state on each screen"""
-    def __init__(self, hysteresis=0):
-      list.__init__(self, [time.time()] * pysaver.screens())
+    def __init__(self, hysteresis=0, idletime=True, xdpy=pysaver):
+      list.__init__(self, [time.time()] * xdpy.screens())
+      self.changed = (1 << len(self)) - 1
+      self.input   = 0
+      self.xdpy = xdpy
       self.hyst = hysteresis;
       self.x    = -self.hyst
       self.y    = -self.hyst
+      self.last = time.time()
+      self.pos  = None
+      try:
+        if idletime: xdpy.idletime()
+        self.idletime = idletime
+      except RuntimeError:
+        logging.info('No IDLETIME counter: polling input state only')
+        self.idletime = False
+      try:
+        xdpy.inputs()
+        self.record = True
+      except RuntimeError:
+        self.record = False
 
     def reset(self, screen, offset=0):
       """Reset timing information on a given screen"""
       self[screen] = time.time() - offset
+      self.changed |= 1 << screen
+
+    def touch(self, screen, offset=0):
+      """Reset a given screen on input, as opposed to commands"""
+      self.reset(screen, offset)
+      self.input |= 1 << screen
       
     def pool(self):
       """Refresh the information: should be called periodically"""
-      screen, ((x, y), keyboard) = pysaver.pool()
+      screen, ((x, y), keyboard) = self.xdpy.pool()
       if not screen is None:
         if (keyboard or
             abs(x-self.x) > self.hyst or
             abs(y-self.y) > self.hyst):
-          self.reset(screen); self.x = x; self.y = y
+          self.touch(screen); self.x = x; self.y = y
+
+        # The server saw some input since last time while the pointer
+        # stayed still: these are keys or buttons the snapshots missed
+        if self.idletime and not self.record:
+          last = time.time() - self.xdpy.idletime() / 1000.
+          if (last > self.last + .05 and self.pos == (screen, x, y) and
+              last > self[screen]):
+            self.touch(screen, time.time() - last)
+          self.last = last
+        self.pos = (screen, x, y)
+
+      # Recorded input is exact: nothing to guess there
+      if self.record:
+        for screen in self.xdpy.inputs():
+          self.touch(screen)
       return self
 
     def activity(self):
@@ -789,17 +1838,33 @@ class Events(list):
       t = time.time()
       return [t - item for item in self]
 
-  def __init__(self, prefs):
+  def __init__(self, prefs, xdpy=pysaver):
     list.__init__(self)
 
     self.prefs    = prefs
-    self.states   = self.States(prefs['hysteresis'])
+    self.xdpy     = xdpy
+    self.states   = self.States(prefs['hysteresis'], prefs['idletime'], xdpy)
     self.modes    = [prefs['mode']]
-    self.screens  = [None] * pysaver.screens()
+    self.screens  = [None] * xdpy.screens()
+    self.alarms   = {}
+    self.hidden   = set()
+    self.powered  = True
+    self.dpms_at  = 0.
+    self.listeners = []
+    self.seen     = list(self.states)
+    self._clear()
     
-    Event.display = prefs['display']
     for evt in prefs['events']: self.append(evt)
 
+  def _clear(self):
+    """Forget all deadlines: every event gets looked at on next pool()"""
+    self.busy  = 0
+    self.dirty = -1
+    self.mode  = None
+    self.heap  = []
+    self.due   = {}
+    self.seq   = itertools.count()
+
   def _check(self, evt):
     """
     Perform a few tests and updates to event internal structure, just
@@ -808,7 +1873,10 @@ class Events(list):
     if not isinstance(evt, Event):
       raise TypeError('%s is not an Event' % repr(evt))
     if isinstance(evt, ManagerEvent): evt.events = self
-    evt.refresh(range(pysaver.screens()))
+    evt.display = self.prefs['display']
+    evt.xdpy    = self.xdpy
+    evt.refresh(range(self.xdpy.screens()))
+    self.dirty = -1
     return evt
   
   def append(self, evt):
@@ -816,11 +1884,141 @@ class Events(list):
 
   def __setitem__(self, k, v):
     list.__setitem__(self, k, self._check(v))
+
+  def arm(self):
+    """
+    Keep one server-side alarm per distinct event threshold, plus one
+    firing on the first input past the shortest of them, so that the
+    X connection wakes us up whenever a transition may be due; if the
+    server refuses them, `alarms' becomes None and activity is sampled
+    """
+    if not self.states.idletime or self.alarms is None: return
+    times = set([evt.time for evt in self if evt.time is not None])
+    wanted = set([(t, False) for t in times] +
+                 ([(min(times), True)] if times else []))
+    for key in set(self.alarms).difference(wanted):
+      self.xdpy.remove_alarm(self.alarms.pop(key))
+    try:
+      for t, negative in wanted.difference(self.alarms):
+        self.alarms[(t, negative)] = self.xdpy.alarm(int(t * 1000),
+                                                     negative)
+    except RuntimeError:
+      logging.info('No IDLETIME alarms: polling input state instead')
+      for alarm in self.alarms.values(): self.xdpy.remove_alarm(alarm)
+      self.alarms = None
+      return
+    self.xdpy.alarms()
+
+  def relayout(self):
+    """
+    Rebuild the panes after a monitors layout change: running events
+    are stopped first, since the screens they cover may be gone
+    """
+    for evt in self:
+      if evt.running(): self._halt(evt)
+    n = self.xdpy.relayout()
+    logging.info('Monitors layout changed: %d screen(s)' % n)
+    self.screens = [None] * n
+    self.states  = self.States(self.prefs['hysteresis'],
+                               self.prefs['idletime'], self.xdpy)
+    self._clear()
+    for evt in self: evt.refresh(range(n))
+
+  def refresh(self):
+    """Refresh all the events, once some external configuration changed"""
+    for evt in self: evt.refresh(evt.srange)
+    self.dirty = -1
+
+  def reload(self, prefs):
+    """
+    Swap in the events of freshly loaded preferences, in place: those
+    matching a current one (see Event.signature()) are kept instead,
+    running or not, while the others are stopped and forgotten. Screens
+    activity and modes are left as they are.
+    """
+    # Events may well be lists (see CompoundEvent): compare identities
+    olds, events = [(evt.signature(), evt) for evt in self], []
+    for evt in prefs['events']:
+      same = [i for i, (sig, old) in enumerate(olds)
+              if sig == evt.signature()]
+      events.append(olds.pop(same[0])[1] if same else evt)
+    for sig, evt in olds:
+      if evt.running(): self._halt(evt)
+      self._schedule(evt, 'start', None)
+      self._schedule(evt, 'tic', None)
+    logging.info('Preferences reloaded: %d event(s) kept, %d dropped' %
+                 (len(self) - len(olds), len(olds)))
+    self.prefs = prefs
+    self.states.hyst = prefs['hysteresis']
+    del self[:]
+    for evt in events: self.append(evt)
+
+  def period(self):
+    """
+    Longest safe delay between two calls to pool(), None meaning
+    forever: IDLETIME alarms wake us up on every threshold and on the
+    first input past them, but cannot tell which screen the input went
+    to, so they only do on a single screen, while recorded input does
+    on any number of them. Otherwise, the pointer is sampled to know
+    where the activity is, and fades are stepped at a decent frame rate
+    """
+    if self.xdpy.fading():
+      return .04
+    if (self.alarms and len(self.screens) == 1) or self.states.record:
+      return None
+    return .1
+
+  def _schedule(self, evt, kind, deadline):
+    """Set (or clear, if None) the `kind' deadline of an event"""
+    if deadline is None:
+      self.due.pop((evt, kind), None)
+    elif self.due.get((evt, kind)) != deadline:
+      self.due[(evt, kind)] = deadline
+      heapq.heappush(self.heap, (deadline, self.seq.next(), kind, evt))
+
+  def _reschedule(self, evt, now):
+    """
+    Compute the next deadlines of an event: its next tic if running,
+    or else the time its least idle screen reaches its threshold (a
+    millisecond past it, match() being strict). An event whose
+    threshold already passed is being held back by a more senior one:
+    it is looked at again once some event stops on its screens.
+    """
+    start = None
+    if (not evt.running() and evt.time is not None and
+        evt.modes is not None and self.modes[-1] in evt.modes and
+        evt.screens and not evt.mask >> len(self.screens)):
+      start = max([self.states[screen] for screen in evt.screens]) + \
+              evt.time + .001
+      if start <= now: start = None
+    self._schedule(evt, 'start', start)
+    self._schedule(evt, 'tic', evt._next_tic if evt.running() else None)
+
+  def next_deadline(self):
+    """
+    Time by which pool() needs to be called again: right away if some
+    screens are due for a look, or else the earliest deadline, within
+    period(). None means only X events or commands matter.
+    """
+    if self.dirty or self.states.changed:
+      return 0
+    while self.heap:
+      deadline, seq, kind, evt = self.heap[0]
+      if self.due.get((evt, kind)) == deadline: break
+      heapq.heappop(self.heap)
+    period = self.period()
+    deadline = time.time() + period if period is not None else None
+    if self.busy and self.dpms_at is not None:
+      deadline = (self.dpms_at if deadline is None else
+                  min(deadline, self.dpms_at))
+    if not self.heap: return deadline
+    return (self.heap[0][0] if deadline is None else
+            min(deadline, self.heap[0][0]))
     
   def pool(self):
     """
     This is the method responsible for scheduling the various events:
-    call it in a relatively tight loop.
+    call it again by next_deadline() at the latest.
 
     The implemented behavior is straightforward:
 
@@ -837,6 +2035,10 @@ class Events(list):
       threshold that has to be reached to activate a given event: the
       longer it takes, the more 'senior' an event is.
 
+    Events are only looked at when something changed on their screens
+    (bitmasks of screen numbers), the mode changed, or one of their
+    deadlines is due: these are kept in a priority queue.
+
     It was written to be pretty resilient to states manipulation by
     ManagerEvents instances, but read the code itself if you ever need
     to write one of these.
@@ -844,24 +2046,56 @@ class Events(list):
     def etime(evt): return evt.time
 
     # Update the activity data
+    self.arm()
     activity = self.states.pool().activity()
+    if self.xdpy.layout_changed():
+      self.relayout()
+      activity = self.states.activity()
+    last, self.seen = self.seen, list(self.states)
+
+    # Gather the events to look at
+    now = time.time()
+    if self.listeners and self.states.input:
+      woken = [screen for screen in xrange(min(len(last), len(activity)))
+               if self.states.input & 1 << screen and
+               now - last[screen] >= self.quiet]
+      if woken: self.notify('activity', screens=woken)
+    self.states.input = 0
+    if self.modes[-1] != self.mode:
+      self.mode  = self.modes[-1]
+      self.dirty = -1
+      self.notify('modes', modes=list(self.modes))
+    dirty = self.dirty | self.states.changed
+    self.dirty = self.states.changed = 0
+    candidates, tics = set(), set()
+    while self.heap and self.heap[0][0] <= now:
+      deadline, seq, kind, evt = heapq.heappop(self.heap)
+      if self.due.get((evt, kind)) == deadline:
+        del self.due[(evt, kind)]
+        (candidates if kind == 'start' else tics).add(evt)
+    if dirty or candidates:
+      candidates = [evt for evt in self
+                    if evt.mask & dirty or evt in candidates]
 
     # Classify the events needing reactions
-    matches   = [evt for evt in self if evt.match(activity, self.modes[-1])]
+    matches   = [evt for evt in candidates
+                 if evt.match(activity, self.modes[-1])]
     inactives = [evt for evt in matches if evt.running()]
     actives   = [evt for evt in matches if not evt.running()]
+    toggled   = []
     
     # Clear all inactive events
     for inactive in inactives:
-      for screen in inactive.screens:
-        self.screens[screen] = None
+      self._release(inactive)
       inactive.toggle()
+      toggled.append(inactive)
 
     # Activate what is activable from wannabe active events: starting with the
     # ones most likely to be activated.
     for active in reversed(sorted(actives, key=etime)):
       conflicts = set([self.screens[screen]
-                       for screen in active.screens])
+                       for screen in active.screens]) \
+                  if active.mask & self.busy else set()
       conflicts.discard(None)
 
       # Bail out if this active event does not have the required seniority
@@ -871,41 +2105,136 @@ class Events(list):
 
       # So we are fine: stop all conflicting events now
       for conflict in conflicts:
-        for screen in conflict.screens:
-          self.screens[screen] = None
+        self._release(conflict)
         conflict.toggle()
+        toggled.append(conflict)
 
       # Fire up this active event
       for screen in active.screens:
         self.screens[screen] = active
+      self.busy |= active.mask
 
       active.toggle()
+      toggled.append(active)
+
+    for evt in toggled: self._told(evt)
+
+    # Tell the running events what cannot be seen, before their tics
+    if self.busy or self.hidden:
+      hidden = self._hidden(now) if self.busy else set()
+      for evt in self:
+        if evt.running() and (hidden != self.hidden or evt in toggled):
+          evt.hide(hidden)
+      self.hidden = hidden
+
+    # Trigger the due tic events, then push the new deadlines
+    for evt in tics:
+      if evt.running(): evt.run_tic()
+    now = time.time()
+    for evt in set(candidates).union(tics, toggled):
+      self._reschedule(evt, now)
+    if len(self.heap) > 4 * len(self.due) + 16:
+      self.heap = [(deadline, seq, kind, evt)
+                   for deadline, seq, kind, evt in self.heap
+                   if self.due.get((evt, kind)) == deadline]
+      heapq.heapify(self.heap)
+
+  def throttle(self, on):
+    """
+    Let the running events know resources became scarce (or no longer
+    are, if not `on'), and look at them again right away
+    """
+    now = time.time()
+    for evt in self:
+      if evt.running():
+        if evt.throttle(on):
+          evt.toggle()
+          evt.toggle()
+        self._reschedule(evt, now)
+
+  def notify(self, topic, **details):
+    for listener in self.listeners: listener(topic, details)
 
-    # And finally make sure to trigger tic events
-    for evt in self: evt.run_tic()
+  def _hidden(self, now):
+    """Screens whose panes cannot be seen (see pysaver visible())"""
+    if self.dpms_at is not None and now >= self.dpms_at:
+      try:
+        self.powered = self.xdpy.dpms()[0] == 'on'
+        self.dpms_at = now + self.dpms_period
+      except RuntimeError:
+        self.powered, self.dpms_at = True, None
+    return set([screen for screen in xrange(len(self.screens))
+                if not self.powered or
+                (self.xdpy.activated(screen) is not None and
+                 not self.xdpy.visible(screen))])
+
+  def halt(self):
+    """Stop all the running events, as the daemon exits"""
+    for evt in self:
+      if evt.running(): self._halt(evt)
+
+  def _halt(self, evt):
+    """Stop a running event out of pool(), telling the listeners"""
+    self._release(evt)
+    evt.toggle()
+    self._told(evt)
+
+  def _told(self, evt):
+    """Tell the listeners an event started or stopped"""
+    self.notify('events', event=evt.dbglabel or repr(evt),
+                running=evt.running(), screens=evt.screens)
+
+  def _release(self, evt):
+    """Free the screens of a stopping event, for others to be looked at"""
+    for screen in evt.screens:
+      self.screens[screen] = None
+      self.busy &= ~(1 << screen)
+    self.dirty |= evt.mask
 
 #-------------------------------------------------------------------------------
 # Various context managers
 #
+def _display_events(prefs):
+  """The (display name, events) pairs described by the preferences"""
+  return [(prefs['display'], prefs['events'])] + \
+         [(_full_name(name), events if events is not None else
+           copy.deepcopy(prefs['events']))
+          for name, events in sorted(prefs['displays'].items())]
+
 class XConnect:
-  """Context manager handling connection to X Server"""
+  """
+  Context manager handling connections to X Servers
+
+  It returns a list of (prefs, connection) pairs, one per display
+  successfully connected to, the display from the prefs coming first
+  (using pysaver module-level connection): it is empty if this one
+  could not be connected to.
+  """
   def __init__(self, prefs):
     self.prefs = prefs
+    self.xdpys = []
     
   def __enter__(self):
-    try:
-      pysaver.connect(self.prefs['display'],
-                      self.prefs['visuals'], self.prefs['hysteresis'])
-    except:
-      logging.error(str(sys.exc_info()[1]))
-      return False
-    else:
-      return True
+    for name, events in _display_events(self.prefs):
+      xdpy = pysaver.Display() if self.xdpys else pysaver
+      try:
+        xdpy.connect(name, self.prefs['visuals'], self.prefs['hysteresis'],
+                     self.prefs['outputs'], self.prefs['record'],
+                     -1 if self.prefs['release'] is None else
+                     self.prefs['release'])
+      except:
+        logging.error('%s: %s' % (name, sys.exc_info()[1]))
+        if not self.xdpys: break
+      else:
+        self.xdpys.append((dict(self.prefs, display=name, events=events),
+                           xdpy))
+    return self.xdpys
             
   def __exit__(self, t, v, tb):
     logging.info('Exiting')
-    if pysaver.connected():
-      pysaver.disconnect()
+    for prefs, xdpy in self.xdpys:
+      if xdpy.connected():
+        xdpy.disconnect()
     return t is None or t is KeyboardInterrupt
 
 class DisplayName:
@@ -928,37 +2257,199 @@ class DisplayName:
 #-------------------------------------------------------------------------------
 # Interprocess communication utilities
 #
+def _full_name(dpy_name):
+  """Make sure a display name specifies the screen"""
+  return dpy_name if '.' in dpy_name.split(':')[-1] else dpy_name + '.0'
+
 def _unix_addr(dpy_name):
   """Compute a unique key for (user, display) combinations"""
   return '\x00xlamesaver-%d-%s' % (os.getuid(),
                                    '.'.join(dpy_name.split('.')[:-1]))
 
-def send_command(dpy_name, cmd):
-  """Send a command to the daemon."""
-  logging.info(cmd)
-  with closing(socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)) as s:
-    try:
-      s.connect(_unix_addr(dpy_name))
-      s.send(cmd + '\n');
-      logging.info(s.recv(1024))
-    except socket.error, e:
-      logging.error(('Could not carry out command (%s): ' + 
-                     'is the daemon running on this display?') % e[1])
+def _connect(dpy_name):
+  """Connect to the daemon, returning the socket and a file reading it"""
+  s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+  try:
+    s.connect(_unix_addr(dpy_name))
+  except:
+    s.close()
+    raise
+  return s, s.makefile('r')
+
+def send_command(dpy_name, *cmds):
+  """
+  Send commands to the daemon, pipelined over a single connection:
+  each one is a tuple of the command name and its arguments.
+  """
+  try:
+    s, f = _connect(dpy_name)
+    with nested(closing(s), closing(f)):
+      for rid, cmd in enumerate(cmds):
+        logging.info(' '.join([str(item) for item in cmd]))
+        s.sendall(json.dumps({'id': rid, 'cmd': cmd[0],
+                              'args': list(cmd[1:])}) + '\n')
+      left = len(cmds)
+      for line in iter(f.readline, ''):
+        reply = json.loads(line)
+        if not reply.has_key('id'): continue
+        if reply.has_key('error'):
+          logging.error(reply['error'])
+        else:
+          logging.info(pprint.pformat(reply['result'])
+                       if reply['result'] is not None else 'OK')
+        left -= 1
+        if not left: break
+  except socket.error, e:
+    logging.error(('Could not carry out command (%s): ' + 
+                   'is the daemon running on this display?') % e[1])
+
+def subscribe(dpy_name, topics=()):
+  """
+  Print the daemon notifications on `topics' (all of them if empty)
+  as lines of JSON, as they come, until the daemon goes away
+  """
+  try:
+    s, f = _connect(dpy_name)
+    with nested(closing(s), closing(f)):
+      s.sendall(json.dumps({'id': 0, 'cmd': 'subscribe',
+                            'args': list(topics)}) + '\n')
+      for line in iter(f.readline, ''):
+        reply = json.loads(line)
+        if reply.has_key('error'):
+          logging.error(reply['error'])
+          break
+        if reply.has_key('topic'):
+          sys.stdout.write(line)
+          sys.stdout.flush()
+  except socket.error, e:
+    logging.error(('Could not subscribe (%s): ' + 
+                   'is the daemon running on this display?') % e[1])
+  except KeyboardInterrupt:
+    pass
 
-class CommandServer(asyncore.dispatcher):
-  """Process incoming commands from daemon"""
-  class CommandChannel(asynchat.async_chat):
-    def __init__(self, conn, server):
-      asynchat.async_chat.__init__(self, conn=conn)
-      self.server = server
-      self.set_terminator('\n')
-      self.cmd = ''
+class CommandServer:
+  """
+  Process incoming commands from daemon
+
+  Clients send one command per line. Plain text ones ('name arg...')
+  get a plain text reply, then the connection is closed. JSON ones
+  ({"id": id, "cmd": name, "args": [arg...]}) get a JSON reply line
+  carrying the same id, and either a "result" or an "error", on a
+  connection kept open for as many as needed: they can be pipelined.
+  The first line tells which protocol the whole connection speaks.
+  Once subscribed to some `topics' (see Events.notify()), a JSON
+  client is also sent {"topic": topic, ...} lines as they happen.
+  """
+  topics = ('activity', 'modes', 'events')
 
-    def collect_incoming_data(self, data):
-      self.cmd += str(data)
+  class CommandChannel:
+    limit = 1 << 20	# Bytes a client may leave unread before being dropped
 
-    def found_terminator(self):
+    def __init__(self, conn, server):
+      self.conn    = conn
+      self.server  = server
+      self.cmd     = ''
+      self.out     = ''
+      self.closing = False
+      self.topics  = set()
+      self.json    = None
+      conn.setblocking(0)
+      server.reactor.register(conn.fileno(), Reactor.IN, self.handle)
+
+    def handle(self, fd, events):
+      if events & Reactor.OUT:
+        self.flush()
+      if self.conn is None or not events & ~Reactor.OUT:
+        return
+      try:
+        data = self.conn.recv(4096)
+      except socket.error, e:
+        if e[0] in (errno.EAGAIN, errno.EINTR): return
+        data = ''
+      if not data:
+        self.close()
+        return
+      self.cmd += data
+      while '\n' in self.cmd and self.conn is not None and not self.closing:
+        line, self.cmd = self.cmd.split('\n', 1)
+        # Commands may have reset timers or switched modes
+        self.server.pending = True
+        self.found_terminator(line)
+
+    def push(self, msg):
+      """Answer right away, leaving the reactor whatever won't fit"""
+      if self.conn is None: return
+      self.out += msg
+      self.flush()
+
+    def flush(self):
+      writing = bool(self.out)
+      try:
+        self.out = self.out[self.conn.send(self.out):]
+      except socket.error, e:
+        # The client may well be gone already: nothing to answer to then
+        if not e[0] in (errno.EAGAIN, errno.EINTR):
+          self.close()
+          return
+      if len(self.out) > self.limit:
+        logging.info('Dropping a client not reading its notifications')
+        self.close()
+      elif not self.out and self.closing:
+        self.close()
+      elif writing != bool(self.out):
+        self.server.reactor.modify(self.conn.fileno(), Reactor.IN |
+                                   (Reactor.OUT if self.out else 0))
+
+    def close_when_done(self):
+      self.closing = True
+      if not self.out: self.close()
+
+    def close(self):
+      if self.conn is None: return
+      self.server.reactor.unregister(self.conn.fileno())
+      self.conn.close()
+      self.conn = None
+      self.server.subscribers.discard(self)
+
+    def notify(self, topic, details):
+      if topic in self.topics:
+        self.push(json.dumps(dict(details, topic=topic), default=repr) + '\n')
+
+    def found_terminator(self, line):
       """Commands from clients are processed here"""
+      if self.json is None:
+        self.json = line.lstrip().startswith('{')
+      if not self.json:
+        s = line.split()
+        msg = self.execute(s[0] if s else 'undefined', s[1:])
+        if not isinstance(msg, str):
+          msg = 'OK' if msg is None else pprint.pformat(msg)
+        self.push(msg)
+        self.close_when_done()
+        return
+
+      rid = None
+      try:
+        request = json.loads(line)
+        rid, cmd = request.get('id'), str(request['cmd'])
+        # Arguments are converted just as plain text ones would be
+        args = [repr(arg) for arg in request.get('args', [])]
+      except (ValueError, KeyError, TypeError, AttributeError), e:
+        reply = {'id': rid, 'error': 'Malformed request (%s)' % e}
+      else:
+        reply = {'id': rid}
+        try:
+          reply['result'] = self.execute(cmd, args, True)
+        except RuntimeError, e:
+          reply['error'] = str(e)
+      self.push(json.dumps(reply, default=repr) + '\n')
+
+    def execute(self, cmd, args, raw=False):
+      """
+      Carry a command out, returning its result: errors are returned
+      as text as well, unless `raw' (for JSON clients), when
+      RuntimeError is raised instead
+      """
       def makedefaults(defaults, args):
         return dict([(item[0], item[1]) for item in defaults] +
                     zip([i[0] for i in defaults],
@@ -966,8 +2457,7 @@ class CommandServer(asyncore.dispatcher):
                          for j, k in enumerate(args)]))
 
       try:
-        cmd = 'undefined'
-        s = self.cmd.split(); cmd = s[0]; args = s[1:]; msg = None
+        msg = None
 
         if cmd == 'reset':
           args = makedefaults([('screen', None, 'int'),
@@ -993,65 +2483,285 @@ class CommandServer(asyncore.dispatcher):
           self.server.events.modes.append(args['mode'])
         elif cmd == 'info':
           logging.debug('Daemon queried for info')
-          msg = pprint.pformat({
+          msg = {
             'display': self.server.prefs['display'], 
-            'screens': range(pysaver.screens()),
+            'screens': range(self.server.xdpy.screens()),
             'modes': self.server.events.modes,
             'active_events:': self.server.events.screens,
-            'activity': self.server.events.states.activity()
-            })
+            'activity': self.server.events.states.activity(),
+            'resources': self.server.xdpy.resources(),
+            'children': _supervisor.report()
+            }
+        elif cmd == 'stats':
+          args = makedefaults([('reset', 0, 'int')], args)
+          logging.debug('Daemon queried for statistics')
+          msg = self.server.xdpy.stats(args['reset'])
+        elif cmd == 'reload':
+          if getattr(self.server, 'reloader', None) is None:
+            raise RuntimeError('Preferences cannot be reloaded')
+          logging.debug('Reloading preferences')
+          self.server.reloader()
+        elif cmd in ('subscribe', 'unsubscribe'):
+          if not raw:
+            raise RuntimeError('Subscriptions need the JSON protocol')
+          topics = set([eval('str(%s)' % arg) for arg in args] or
+                       self.server.topics)
+          if topics.difference(self.server.topics):
+            raise RuntimeError('Unknown topics "%s"' %
+                               '", "'.join(topics - set(self.server.topics)))
+          if cmd == 'subscribe':
+            self.topics |= topics
+          else:
+            self.topics -= topics
+          if self.topics:
+            self.server.subscribers.add(self)
+          else:
+            self.server.subscribers.discard(self)
+          msg = sorted(self.topics)
         elif cmd == 'exit':
           self.server.exit = True
         else:
           raise RuntimeError('Unknown command "%s"' % cmd)
       except RuntimeError, e:
+        if raw: raise
         msg = str(e)
       except:
+        logging.error('Command "%s" triggered an error in daemon' % cmd)
         msg = 'Error from daemon:\n==================\n' + \
               ''.join(traceback.format_exception(*sys.exc_info()))
-        logging.error('Command "%s" triggered an error in daemon' % cmd)
-      else:
-        if msg is None: msg = 'OK'
-      finally:
-        self.push(msg)
-        self.close_when_done()
+        if raw: raise RuntimeError(msg)
+      return msg
 
-  def __init__(self, prefs):
-    asyncore.dispatcher.__init__(self)
-    self.prefs  = prefs
+  def __init__(self, prefs, xdpy=pysaver):
+    self.prefs   = prefs
+    self.xdpy    = xdpy
+    self.reactor = None
+    self.socket  = None
+    self.events  = None
+    self.subscribers = set()
 
   def __enter__(self):
     try:
-      self.events = Events(self.prefs)
+      self.events = Events(self.prefs, self.xdpy)
+      self.events.listeners.append(self.notify)
       self.exit = False
-      os.nice(self.prefs['nice'])
-      self.create_socket(socket.AF_UNIX, socket.SOCK_STREAM)
-      self.bind(_unix_addr(self.prefs['display']))
-      self.listen(1)
+      self.pending = False
+      self.socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+      self.socket.setblocking(0)
+      self.socket.bind(_unix_addr(self.prefs['display']))
+      self.socket.listen(1)
     except socket.error, e:
       logging.error('%s: would a daemon already be running?' % e[1])
       return None
     else:
-      logging.info('Daemon started, listening...')
+      logging.info('Daemon started on %s, listening...' %
+                   self.prefs['display'])
       return self
 
   def __exit__(self, t, v, tb):
-    self.close()
+    if self.events is not None:
+      self.events.halt()
+    if self.socket is not None:
+      self.socket.close()
     return t is None
 
-  def handle_accept(self):
-    channel, addr = self.accept()
+  def attach(self, reactor):
+    """Have commands (and X events) dispatched by `reactor'"""
+    self.reactor = reactor
+    reactor.register(self.socket.fileno(), Reactor.IN, self.handle_accept)
+    for fd in (self.xdpy.fileno(), self.xdpy.record_fileno()):
+      if fd is not None:
+        reactor.register(fd, Reactor.IN, self.handle_x)
+
+  def handle_accept(self, fd, events):
+    try:
+      channel, addr = self.socket.accept()
+    except socket.error, e:
+      if e[0] in (errno.EAGAIN, errno.EINTR): return
+      raise
     self.CommandChannel(channel, self)
-  
-  def handle_connect(self): pass
-  def handle_write(self): pass
+
+  def handle_x(self, fd, events):
+    self.pending = True
+
+  def notify(self, topic, details):
+    """Pass an Events transition on to the subscribed clients"""
+    for channel in list(self.subscribers):
+      channel.notify(topic, dict(details, display=self.prefs['display']))
 
   def loop(self):
-    while not self.exit:
-      t = time.time()
-      asyncore.loop(count=1)
-      self.events.pool()
-      time.sleep(max(t + .1 - time.time(), 0))
+    serve([self])
+
+class Reloader:
+  """
+  Bring preferences changes to the servers, without reconnecting: the
+  xlamesaver preferences events are swapped in place (see
+  Events.reload()), while XScreenSaver preferences changes are picked
+  by refreshing the events.
+  """
+  def __init__(self, prefs, servers):
+    self.prefs   = prefs
+    self.servers = servers
+
+  def arm(self, watcher):
+    """Have the preferences files in use watched"""
+    watcher.watch(self.prefs.path, self)
+    for path in XScreenSaverPrefs.paths() + HackCosts.paths():
+      watcher.watch(path, self.refresh)
+    self.watcher = watcher
+
+  def __call__(self):
+    try:
+      prefs = self.prefs.reload()
+      displays = dict(_display_events(prefs))
+      for server in self.servers:
+        name = server.prefs['display']
+        if displays.has_key(name):
+          server.prefs = dict(server.prefs, events=displays[name],
+                              hysteresis=prefs['hysteresis'])
+          server.events.reload(server.prefs)
+          server.pending = True
+    except:
+      logging.error('Preferences not reloaded:\n' +
+                    ''.join(traceback.format_exception(*sys.exc_info())))
+      return
+    for key in ('display', 'visuals', 'idletime', 'outputs', 'record',
+                'release', 'nice', 'cgroup', 'displays'):
+      if prefs[key] != self.prefs[key]:
+        logging.info('Changing "%s" needs a daemon restart' % key)
+    if [key for key in ('pressure', 'pressure_action')
+        if prefs[key] != self.prefs[key]]:
+      _pressure.setup(prefs['pressure'], prefs['pressure_action'])
+    self.prefs = prefs
+    _budget.limit = prefs['cpu_budget']
+    if getattr(self, 'watcher', None): self.arm(self.watcher)
+
+  def refresh(self):
+    try:
+      for server in self.servers:
+        server.events.refresh()
+        server.pending = True
+    except:
+      logging.error('XScreenSaver preferences not applied:\n' +
+                    ''.join(traceback.format_exception(*sys.exc_info())))
+
+def serve(servers, prefs=None):
+  """
+  Sleep until a command comes in, X events are received on any of the
+  servers displays, a child exits or the next deadline of any of them
+  is due (see Events.next_deadline()), whatever comes first, all of
+  them being multiplexed by a single Reactor: commands are thus
+  answered right away, panes desactivated as soon as they see any
+  activity, and events started on time, without waking up otherwise.
+  It returns as soon as any of the servers is asked to exit.
+
+  Given the preferences (see XLameSaverPrefs), their changes are
+  applied as soon as written, where inotify is available, or else on
+  'reload' commands. Pressure triggers (see Pressure) are part of the
+  loop as well.
+  """
+  reactor = Reactor()
+  reloader = Reloader(prefs, servers) if prefs is not None else None
+  for server in servers:
+    server.attach(reactor)
+    server.pending = True
+    server.reloader = reloader
+  sigfd = _protect.shield()
+  if sigfd is not None:
+    reactor.register(sigfd, Reactor.IN, _protect.reap)
+  watcher = Watcher()
+  if reloader is not None and watcher.fileno() is not None:
+    reloader.arm(watcher)
+    reactor.register(watcher.fileno(), Reactor.IN, watcher)
+  _pressure.attach(reactor, servers)
+
+  deadlines = dict([(server, 0) for server in servers])
+  while not [server for server in servers if server.exit]:
+    # Xlib may already have queued events the descriptors won't tell about
+    for server in servers:
+      if server.xdpy.wait(0)[0]: server.pending = True
+    if [server for server in servers if server.pending]:
+      timeout = 0
+    else:
+      pending = [d for d in deadlines.values() +
+                 [_supervisor.next_deadline(), _pressure.next_deadline(),
+                  _budget.next_deadline()]
+                 if d is not None]
+      timeout = max(min(pending) - time.time(), 0) if pending else None
+    reactor.poll(timeout)
+    _supervisor.escalate()
+    _pressure.expire()
+    deadline = _budget.next_deadline()
+    if deadline is not None and deadline <= time.time(): _budget.sample()
+
+    for server in servers:
+      if (server.pending or (deadlines[server] is not None and
+                             time.time() >= deadlines[server])):
+        server.pending = False
+        server.events.pool()
+        deadlines[server] = server.events.next_deadline()
+
+#-------------------------------------------------------------------------------
+# Hacks benchmarking
+#
+def benchmark(duration=10., xscreensaver_config='%(HOME)s/.xscreensaver',
+              hacks_path='/usr/lib/misc/xscreensaver',
+              costs='%(HOME)s/.xlamesaver.costs', geometry='1280x1024x24'):
+  """
+  Measure the costs of all the hacks from XScreenSaver preferences:
+  each one is run for `duration' seconds on a pane of a private Xvfb
+  server, then its CPU time, peak resident size, and the frames it
+  drew (when DAMAGE is available) are written to the `costs' database
+  (see HackCosts), merged with what it held.
+  """
+  programs = XScreenSaverPrefs(xscreensaver_config)['programs']
+  db = HackCosts(costs)
+
+  # Xvfb picks a free display, and tells which through the pipe
+  r, w = os.pipe()
+  try:
+    server = subprocess.Popen(['Xvfb', '-displayfd', str(w), '-nolisten',
+                               'tcp', '-screen', '0', geometry])
+  except OSError, e:
+    os.close(r)
+    logging.error('Could not start Xvfb: %s' % e)
+    return
+  finally:
+    os.close(w)
+  try:
+    with closing(os.fdopen(r)) as f:
+      display = ':%s' % f.readline().strip()
+    xdpy = pysaver.Display()
+    xdpy.connect(display)
+    os.environ['DISPLAY'] = display
+    for hack, program in sorted(programs.iteritems()):
+      xdpy.activate(0)
+      window = xdpy.standby(0)
+      child = ExternalProcessEvent.Child(
+        os.path.join(hacks_path, program['cmd']) +
+        ' -window-id 0x%x' % window)
+      start = time.time()
+      while time.time() - start < duration and child.poll() is None:
+        xdpy.wait(.1)
+        xdpy.pool()
+      elapsed = time.time() - start
+      frames = xdpy.frames(0)
+      child.kill()
+      while child.poll() is None:
+        time.sleep(.05)
+        _supervisor.escalate()
+      xdpy.desactivate(0)
+
+      rusage = child.rusage
+      db[hack] = {'cpu': (rusage.ru_utime + rusage.ru_stime) / elapsed,
+                  'rss': rusage.ru_maxrss,
+                  'fps': frames / elapsed if frames is not None else None}
+      logging.info('%s: %s' % (hack, db[hack]))
+    xdpy.disconnect()
+  finally:
+    os.kill(server.pid, signal.SIGTERM)
+    server.wait()
+  db.save(costs)
 
 #-------------------------------------------------------------------------------
 # Entry point
@@ -1109,6 +2819,24 @@ WARRANTY, to the extent permitted by law.""")
   p.add_option('-i', '--info',
                dest='info', action='store_true', default=False,
                help='query info from daemon')
+  p.add_option('-s', '--stats',
+               dest='stats', action='store_true', default=False,
+               help=('query X round trips and latency statistics ' +
+                     'from daemon'))
+  p.add_option('-l', '--reload',
+               dest='reload', action='store_true', default=False,
+               help='ask daemon to reload its preferences')
+  p.add_option('-b', '--benchmark',
+               dest='benchmark', action='store', default=None, type='float',
+               metavar='SECONDS',
+               help=('run every XScreenSaver hack for that many seconds ' +
+                     'under Xvfb, and record their costs'))
+  p.add_option('-w', '--subscribe',
+               dest='subscribe', action='store', default=None, type='string',
+               metavar='TOPICS',
+               help=('print the daemon notifications on the comma-separated ' +
+                     'TOPICS (activity, modes, events, or all) as lines of ' +
+                     'JSON, as they come'))
   p.add_option('-e', '--exit',
                dest='exit', action='store_true', default=False,
                help='ask daemon to exit')
@@ -1118,9 +2846,9 @@ WARRANTY, to the extent permitted by law.""")
   # Determine the invocation mode
   #
   daemonic = not (opts.screen is not None or
-                  opts.all or opts.info or opts.pop or
-                  opts.mode is not None or
-                  opts.exit)
+                  opts.all or opts.info or opts.stats or opts.pop or
+                  opts.mode is not None or opts.subscribe is not None or
+                  opts.reload or opts.exit)
 
   # Set up the logging facility
   #
@@ -1132,38 +2860,70 @@ WARRANTY, to the extent permitted by law.""")
                       format='%(asctime)s %(levelname)s %(message)s'
                       if daemonic else '%(message)s')
 
+  # Benchmarking needs nothing from the display
+  #
+  if opts.benchmark is not None:
+    prefs = XLameSaverPrefs(opts.prefs)
+    evts = [evt for evt in prefs['events']
+            if isinstance(evt, XScreenSaverEvent)]
+    if evts:
+      benchmark(opts.benchmark, evts[0].xpath, evts[0].path, evts[0].cpath)
+    else:
+      benchmark(opts.benchmark)
+    return
+
   with DisplayName(opts.display) as display:
     if not display is None:      
       # ...then act on it.
       if daemonic:
         # Daemonic invocation
         prefs = XLameSaverPrefs(opts.prefs, display=display)
-        with XConnect(prefs) as xstatus:
-          if xstatus:
-            with CommandServer(prefs) as server:
-              if not server is None:
-                server.loop()
+        with XConnect(prefs) as xdpys:
+          if xdpys:
+            os.nice(prefs['nice'])
+            _cgroups.setup(prefs['cgroup'])
+            _budget.limit = prefs['cpu_budget']
+            _pressure.setup(prefs['pressure'], prefs['pressure_action'])
+            with nested(*[CommandServer(p, xdpy)
+                          for p, xdpy in xdpys]) as servers:
+              if not servers[0] is None:
+                serve([server for server in servers if server is not None],
+                      prefs)
           else:
             logging.error('Daemon X initialization failed')
       else:
-        # Command line invocation
+        # Command line invocation, over a single connection
+        cmds = []
         if opts.screen is not None:
-          send_command(display, 'reset %d %d' % (opts.screen, opts.time))
+          cmds.append(('reset', opts.screen, opts.time))
     
         if opts.all:
-          send_command(display, 'resetall %d' % (opts.time))
+          cmds.append(('resetall', opts.time))
 
         if opts.pop:
-          send_command(display, 'pop')
+          cmds.append(('pop',))
           
         if opts.mode is not None:
-          send_command(display, 'mode "%s"' % (opts.mode))
+          cmds.append(('mode', opts.mode))
 
         if opts.info:
-          send_command(display, 'info')
+          cmds.append(('info',))
       
+        if opts.stats:
+          cmds.append(('stats',))
+
+        if opts.reload:
+          cmds.append(('reload',))
+
         if opts.exit:
-          send_command(display, 'exit')
+          cmds.append(('exit',))
+
+        if cmds:
+          send_command(display, *cmds)
+
+        if opts.subscribe is not None:
+          subscribe(display, [topic for topic in opts.subscribe.split(',')
+                              if topic not in ('', 'all')])
 
 #-------------------------------------------------------------------------------
 # Invoke the entry point if not called as module
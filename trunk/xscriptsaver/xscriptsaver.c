@@ -2,9 +2,12 @@
 X11 utility for watching keyboard or mouse activity on default X11 display until
 a timeout is reached.
 
-------------------------------------------------
-Usage: xscriptsaver [-w|--wait] timeout
--------------------------------------------------
+------------------------------------------------------------------------
+Usage: xscriptsaver [-w|--wait] [-f] [-p process] [-i file] ... timeout
+       xscriptsaver -m|--monitors [-f] [-p process] [-i file] ... timeout ...
+       xscriptsaver -s|--serve
+       xscriptsaver -I|--inhibit
+------------------------------------------------------------------------
 
 It returns when:
 
@@ -24,9 +27,89 @@ exit on conditions (2) or (3).
 xscriptsaver allows writing special purpose screensavers or idle-time manager
 for the X Window System. See 'xscriptsaver.sh' for an example.
 
+Inhibitors
+~~~~~~~~~~
+The timeout can be postponed under given conditions, without spawning a single
+process to check them:
+
+-f, --fullscreen:: while the active window (as advertised by the window manager
+  through '_NET_ACTIVE_WINDOW') of any screen is in fullscreen state; this is
+  tracked through property change events, not polled.
+
+-p, --process name:: while a process with the given command name (see
+  '/proc/<pid>/comm') belonging to the current user is running; process names
+  are scanned from '/proc' at most once every ten seconds.
+
+-i, --inhibit-file path:: while the given file exists; a relative path is
+  taken from the current directory.
+
+All three can be given multiple times, but process names and paths cannot
+contain whitespace. They are only evaluated when the timeout
+is reached: if any of them holds, the timeout is restarted from scratch, just
+as if the user had been active at that instant (but without reporting
+activity).
+
+Per-monitor mode
+~~~~~~~~~~~~~~~~
+With the '--monitors' flag, xscriptsaver tracks idle time separately on each
+monitor, attributing pointer activity to the monitor the pointer is on, and
+keyboard activity to the monitor the pointer was last seen on. Monitors are
+the outputs of each X screen as reported by RandR (when compiled with
+HAVE_XRANDR, see below, and rebuilt on every layout change), or the X screens
+themselves otherwise. It then never returns on its own, writing transitions on
+standard output as they happen, one per line:
+
+- 'idle <timeout> <monitor>' each time one of the given timeouts (there can be
+  many) is reached on a monitor;
+
+- 'active <monitor>' on the first activity following an 'idle' line for the
+  same monitor;
+
+where <monitor> is '<screen>:<output>' ('0:HDMI-1', '1:DVI-0', ...), or just
+'<screen>' without RandR. A script can then blank only the monitors nobody is
+looking at. Inhibitors apply to all monitors at once.
+
+Service mode
+~~~~~~~~~~~~
+When invoked with the '--serve' flag, xscriptsaver never returns on its own:
+it becomes the single process polling the display, publishing activity
+transitions over a per-user, per-display Unix socket to any number of
+subscribers. Every other invocation of xscriptsaver on the same display
+then transparently subscribes to it instead of polling X by itself, so that
+the polling cost stays the same no matter how many scripts are watching; it
+still falls back to polling X should the service be busy or go away.
+
+The protocol is line-based and can be spoken by any other program: a
+subscriber first sends
+
+  watch [-m] [inhibitor ...] [threshold ...]
+
+where inhibitors are the same as the command line ones, and thresholds are idle
+times in seconds, and then receives (with '-m', per-monitor lines are sent
+instead, as described above):
+
+- 'idle <threshold>' each time one of its thresholds is reached, at most
+  once per idle period (idle time is counted from the later of the last
+  activity or the subscription itself);
+
+- 'active' on the first activity following its subscription, and on the
+  first activity following every 'idle' notification;
+
+- 'busy' if the service cannot take any more subscribers, right before
+  the connection is closed.
+
+A connection can send 'inhibit' instead: all the subscribers of the service
+are then inhibited for as long as it stays open; this is what the '--inhibit'
+flag does, until xscriptsaver is killed.
+
+The socket is an abstract one, named '@xscriptsaver-<uid>-<display>' where
+<display> is the display name stripped of its screen number. Abstract sockets
+being a Linux extension, the service mode is Linux-only: elsewhere, '--serve'
+fails and every other invocation polls X by itself, as it always did.
+
 Requirements
 ~~~~~~~~~~~~
-- A reasonnably POSIX compliant system
+- A reasonnably POSIX compliant system (Linux for the service mode)
 - A working C compiler with the basic libraries (this code is C90 plus
   variadic macros... Any gcc version less than ten years old should do)
 - X11 libraries and headers
@@ -35,6 +118,7 @@ Compilation
 ~~~~~~~~~~~
 Normal build:: `cc -lX11 -o xscriptserver xscriptsever.c`
 Debug  build:: `cc -lX11 -DDEBUG -o xscriptserver xscriptsever.c`
+RandR  build:: `cc -lX11 -lXrandr -DHAVE_XRANDR -o xscriptserver xscriptsever.c`
 
 You might have to adjust the library or headers path, depending on your system.
 
@@ -68,15 +152,39 @@ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ------------------------------------------------------------------------------*/
 #include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #define HYSTERESIS 10
+#define TICK 100000		/* Polling period, in microseconds */
+#define TICKS_PER_SECOND (1000000 / TICK)
+#define PROC_REFRESH (10 * TICKS_PER_SECOND)
+
+#define MAX_SUBSCRIBERS 64
+#define MAX_THRESHOLDS  16
+#define MAX_INHIBITORS  8
+#define MAX_REGIONS     16
+#define MAX_PROCS       1024
+#define MAX_ARGS        (2 * MAX_INHIBITORS + MAX_THRESHOLDS + 3)
+#define LINE_SIZE       512
 
 #define die(...) \
   do { fprintf(stderr, __VA_ARGS__); goto fail; } while(0)
@@ -89,6 +197,129 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 /*----------------------------------------------------------------------------*/
+/* Watch options: conditions postponing the timeout, and granularity
+ */
+typedef struct {
+  int monitors, fullscreen, nprocs, nfiles;
+  char * procs[MAX_INHIBITORS];
+  char * files[MAX_INHIBITORS];
+} Options;
+
+/* A subscriber to the service: all times are in ticks. The per-region
+   arrays are only used up to the number of regions in per-monitor mode,
+   their first slot standing for the whole display otherwise.
+ */
+typedef struct {
+  int fd, len, token, nthres;
+  long since;
+  long thres[MAX_THRESHOLDS];
+  int next[MAX_REGIONS], armed[MAX_REGIONS];
+  long seen[MAX_REGIONS];
+  Options opts;
+  char line[LINE_SIZE];
+} Subscriber;
+
+static Subscriber subs[MAX_SUBSCRIBERS];
+static int ntokens;
+
+/* Monitors: see build_regions()
+ */
+typedef struct {
+  int screen, x, y, width, height;
+  char name[32];
+} Region;
+
+static Region regions[MAX_REGIONS];
+static int nregions, cur;
+
+/* Fullscreen tracking state
+ */
+static Atom net_active, net_state, net_fullscreen;
+static Window * active;
+static int fullscreen;
+
+#ifdef HAVE_XRANDR
+static int rr_event, rr_error;
+#endif
+
+/* Cached process names
+ */
+static char procs[MAX_PROCS][16];
+static int nprocs;
+static long procs_stamp = -1;
+
+/*----------------------------------------------------------------------------*/
+/* Split the display into monitors, one per connected RandR output, or one
+   per screen if RandR is unavailable.
+ */
+static void
+build_regions(Display * dpy) {
+  int i;
+  Region * r;
+#ifdef HAVE_XRANDR
+  int j;
+  XRRScreenResources * res;
+  XRROutputInfo * out;
+  XRRCrtcInfo * crtc;
+#endif
+
+  for (i = 0, nregions = 0; i < ScreenCount(dpy); ++i) {
+#ifdef HAVE_XRANDR
+    if (XRRQueryExtension(dpy, &rr_event, &rr_error) &&
+	(res = XRRGetScreenResources(dpy, RootWindow(dpy, i)))) {
+      for (j = 0; j < res->noutput && nregions < MAX_REGIONS; ++j) {
+	if (!(out = XRRGetOutputInfo(dpy, res, res->outputs[j])))
+	  continue;
+	if (out->connection == RR_Connected && out->crtc &&
+	    (crtc = XRRGetCrtcInfo(dpy, res, out->crtc))) {
+	  r = &regions[nregions++];
+	  r->screen = i;
+	  r->x = crtc->x;
+	  r->y = crtc->y;
+	  r->width = crtc->width;
+	  r->height = crtc->height;
+	  snprintf(r->name, sizeof(r->name), "%d:%s", i, out->name);
+	  XRRFreeCrtcInfo(crtc);
+	}
+	XRRFreeOutputInfo(out);
+      }
+      XRRFreeScreenResources(res);
+      if (nregions && regions[nregions - 1].screen == i)
+	continue;
+    }
+#endif
+    if (nregions == MAX_REGIONS)
+      break;
+    r = &regions[nregions++];
+    r->screen = i;
+    r->x = r->y = 0;
+    r->width = WidthOfScreen(ScreenOfDisplay(dpy, i));
+    r->height = HeightOfScreen(ScreenOfDisplay(dpy, i));
+    snprintf(r->name, sizeof(r->name), "%d", i);
+  }
+
+#ifdef DEBUG
+  for (i = 0; i < nregions; ++i)
+    debug("Monitor %s: %dx%d+%d+%d\n", regions[i].name,
+	  regions[i].width, regions[i].height, regions[i].x, regions[i].y);
+#endif
+  cur = 0;
+}
+
+static int
+find_region(int screen, int x, int y) {
+  int i;
+  for (i = 0; i < nregions; ++i)
+    if (regions[i].screen == screen &&
+	x >= regions[i].x && x < regions[i].x + regions[i].width &&
+	y >= regions[i].y && y < regions[i].y + regions[i].height)
+      return i;
+  return cur;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Check the pointer for movement, keeping track of the monitor it is on
+ */
 static int
 query_pointer(Display * dpy) {
   static int ox = -1, oy = -1;
@@ -108,6 +339,7 @@ query_pointer(Display * dpy) {
 	ox = nx;
 	oy = ny;
       }
+      cur = find_region(i, nx, ny);
       return r;
     }
   return 0;
@@ -124,51 +356,822 @@ query_keyboard(Display * dpy) {
   return 0;
 }
 
+/*----------------------------------------------------------------------------*/
+/* Windows we track can vanish anytime: ignore the resulting errors,
+   and only those, anything else going to the previous handler
+ */
+static int (*default_errors)(Display *, XErrorEvent *);
+
+static int
+ignore_errors(Display * dpy, XErrorEvent * ev) {
+  if (ev->error_code != BadWindow && ev->error_code != BadMatch)
+    return default_errors(dpy, ev);
+  debug("Ignoring X error %d\n", ev->error_code);
+  return 0;
+}
+
+static int
+window_fullscreen(Display * dpy, Window w) {
+  Atom type, * atoms;
+  int format, r = 0;
+  unsigned long i, n, left;
+  unsigned char * data = NULL;
+
+  if (w != None &&
+      XGetWindowProperty(dpy, w, net_state, 0, 64, False, XA_ATOM,
+			 &type, &format, &n, &left, &data) == Success &&
+      data) {
+    if (type == XA_ATOM && format == 32)
+      for (atoms = (Atom *)data, i = 0; i < n && !r; ++i)
+	r = atoms[i] == net_fullscreen;
+    XFree(data);
+  }
+  return r;
+}
+
+/* Follow the active window on a given screen, so that we get its state
+   changes
+ */
+static void
+track_active(Display * dpy, int screen) {
+  Atom type;
+  int format;
+  unsigned long n, left;
+  unsigned char * data = NULL;
+  Window w = None;
+
+  if (XGetWindowProperty(dpy, RootWindow(dpy, screen), net_active,
+			 0, 1, False, XA_WINDOW,
+			 &type, &format, &n, &left, &data) == Success &&
+      data) {
+    if (type == XA_WINDOW && format == 32 && n == 1)
+      w = *(Window *)data;
+    XFree(data);
+  }
+
+  if (w != active[screen]) {
+    debug("Active window on screen %d: 0x%lx\n", screen, w);
+    if (active[screen] != None)
+      XSelectInput(dpy, active[screen], NoEventMask);
+    if (w != None)
+      XSelectInput(dpy, w, PropertyChangeMask);
+    active[screen] = w;
+  }
+}
+
+static void
+update_fullscreen(Display * dpy) {
+  int i;
+  for (i = 0, fullscreen = 0; i < ScreenCount(dpy) && !fullscreen; ++i)
+    fullscreen = window_fullscreen(dpy, active[i]);
+  debug("Fullscreen: %d\n", fullscreen);
+}
+
+static int
+fullscreen_init(Display * dpy) {
+  int i;
+
+  if (!(active = calloc(ScreenCount(dpy), sizeof(Window))))
+    return 0;
+  default_errors = XSetErrorHandler(ignore_errors);
+  net_active     = XInternAtom(dpy, "_NET_ACTIVE_WINDOW", False);
+  net_state      = XInternAtom(dpy, "_NET_WM_STATE", False);
+  net_fullscreen = XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
+  for (i = 0; i < ScreenCount(dpy); ++i) {
+    XSelectInput(dpy, RootWindow(dpy, i), PropertyChangeMask);
+    track_active(dpy, i);
+  }
+  update_fullscreen(dpy);
+  return 1;
+}
+
+/* Process pending property changes and layout changes: nothing is polled
+   here. Returns non-zero if the monitors were rebuilt.
+ */
+static int
+process_events(Display * dpy) {
+  XEvent ev;
+  int i, dirty = 0, rebuild = 0;
+
+  while (XPending(dpy)) {
+    XNextEvent(dpy, &ev);
+#ifdef HAVE_XRANDR
+    if (ev.type == rr_event + RRScreenChangeNotify) {
+      XRRUpdateConfiguration(&ev);
+      rebuild = 1;
+      continue;
+    }
+#endif
+    if (!active || ev.type != PropertyNotify)
+      continue;
+    if (ev.xproperty.atom == net_active) {
+      for (i = 0; i < ScreenCount(dpy); ++i)
+	if (RootWindow(dpy, i) == ev.xproperty.window)
+	  track_active(dpy, i);
+      dirty = 1;
+    } else if (ev.xproperty.atom == net_state)
+      dirty = 1;
+  }
+  if (dirty)
+    update_fullscreen(dpy);
+  if (rebuild)
+    build_regions(dpy);
+  return rebuild;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Scan the current user's processes names
+ */
+static void
+scan_procs(void) {
+  DIR * dir;
+  struct dirent * ent;
+  struct stat st;
+  char path[64];
+  int fd, n;
+
+  nprocs = 0;
+  if (!(dir = opendir("/proc")))
+    return;
+  while ((ent = readdir(dir)) && nprocs < MAX_PROCS) {
+    if (*ent->d_name < '0' || *ent->d_name > '9')
+      continue;
+    snprintf(path, sizeof(path), "/proc/%.32s", ent->d_name);
+    if (stat(path, &st) != 0 || st.st_uid != getuid())
+      continue;
+    strncat(path, "/comm", sizeof(path) - strlen(path) - 1);
+    if ((fd = open(path, O_RDONLY)) < 0)
+      continue;
+    if ((n = read(fd, procs[nprocs], sizeof(procs[0]) - 1)) > 0) {
+      procs[nprocs][n] = '\0';
+      procs[nprocs][strcspn(procs[nprocs], "\n")] = '\0';
+      ++nprocs;
+    }
+    close(fd);
+  }
+  closedir(dir);
+  debug("Scanned %d processes\n", nprocs);
+}
+
+static int
+process_running(const char * name, long now) {
+  int i;
+
+  if (procs_stamp < 0 || now - procs_stamp >= PROC_REFRESH) {
+    scan_procs();
+    procs_stamp = now;
+  }
+  for (i = 0; i < nprocs; ++i)
+    if (!strncmp(procs[i], name, sizeof(procs[0]) - 1))
+      return 1;
+  return 0;
+}
+
+static int
+inhibited(Options * opts, long now) {
+  struct stat st;
+  int i;
+
+  if (ntokens || (opts->fullscreen && fullscreen))
+    return 1;
+  for (i = 0; i < opts->nprocs; ++i)
+    if (process_running(opts->procs[i], now))
+      return 1;
+  for (i = 0; i < opts->nfiles; ++i)
+    if (stat(opts->files[i], &st) == 0)
+      return 1;
+  return 0;
+}
+
+/* Parse a watch option from argv[*i], shared between the command line and
+   the service protocol: returns zero on failure, leaving *i on the last
+   argument consumed otherwise.
+ */
+static int
+parse_option(Options * opts, int argc, char ** argv, int * i) {
+  char * flag = argv[*i];
+
+  if (!strcmp(flag, "-m") || !strcmp(flag, "--monitors")) {
+    opts->monitors = 1;
+    return 1;
+  }
+  if (!strcmp(flag, "-f") || !strcmp(flag, "--fullscreen")) {
+    opts->fullscreen = 1;
+    return 1;
+  }
+  if (*i + 1 >= argc)
+    return 0;
+  if (!strcmp(flag, "-p") || !strcmp(flag, "--process")) {
+    if (opts->nprocs == MAX_INHIBITORS) return 0;
+    opts->procs[opts->nprocs++] = argv[++*i];
+    return 1;
+  }
+  if (!strcmp(flag, "-i") || !strcmp(flag, "--inhibit-file")) {
+    if (opts->nfiles == MAX_INHIBITORS) return 0;
+    opts->files[opts->nfiles++] = argv[++*i];
+    return 1;
+  }
+  return 0;
+}
+
+/* Check the command line inhibitors, making the files absolute: the
+   service checks them from a working directory of its own. Returns zero
+   on any inhibitor the line protocol could not carry.
+ */
+static int
+inhibitors_fix(Options * opts) {
+  char cwd[PATH_MAX], * path;
+  int i;
+
+  for (i = 0; i < opts->nprocs; ++i)
+    if (strpbrk(opts->procs[i], " \t\r\n"))
+      return 0;
+  for (i = 0; i < opts->nfiles; ++i) {
+    if (strpbrk(opts->files[i], " \t\r\n"))
+      return 0;
+    if (*opts->files[i] == '/')
+      continue;
+    if (!getcwd(cwd, sizeof(cwd)) ||
+	!(path = malloc(strlen(cwd) + strlen(opts->files[i]) + 2)))
+      return 0;
+    sprintf(path, "%s/%s", cwd, opts->files[i]);
+    opts->files[i] = path;
+  }
+  return 1;
+}
+
+/* Build the subscription line matching given options and thresholds
+ */
+static int
+watch_line(char * line, int size, Options * opts, int nthres, int * thres) {
+  int i, len;
+
+  len = snprintf(line, size, "watch%s%s",
+		 (opts->monitors)?" -m":"", (opts->fullscreen)?" -f":"");
+  for (i = 0; i < opts->nprocs && len < size; ++i)
+    len += snprintf(&line[len], size - len, " -p %s", opts->procs[i]);
+  for (i = 0; i < opts->nfiles && len < size; ++i)
+    len += snprintf(&line[len], size - len, " -i %s", opts->files[i]);
+  for (i = 0; i < nthres && len < size; ++i)
+    len += snprintf(&line[len], size - len, " %d", thres[i]);
+  if (len < size)
+    len += snprintf(&line[len], size - len, "\n");
+  return (len < size)?len:-1;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Compute the service address for the default display: the screen number
+   is stripped, so that all screens share the same service.
+ */
+static int
+service_addr(struct sockaddr_un * addr) {
+  char * name, * colon, * dot;
+  int n;
+
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if (!(name = XDisplayName(NULL)) || !strlen(name))
+    return -1;
+  n = strlen(name);
+  if ((colon = strrchr(name, ':')) && (dot = strchr(colon, '.')))
+    n = dot - name;
+  n = snprintf(&addr->sun_path[1], sizeof(addr->sun_path) - 1,
+	       "xscriptsaver-%d-%.*s", (int)getuid(), n, name);
+  if (n < 0 || n >= sizeof(addr->sun_path) - 1)
+    return -1;
+  return sizeof(sa_family_t) + 1 + n;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+notify(Subscriber * sub, const char * msg) {
+  int n = strlen(msg);
+  if (write(sub->fd, msg, n) != n) {
+    debug("Dropping subscriber on fd %d\n", sub->fd);
+    close(sub->fd);
+    sub->fd = -1;
+    return 0;
+  }
+  return 1;
+}
+
+/* Reset the per-region thresholds tracking of a subscriber
+ */
+static void
+subscriber_reset(Subscriber * sub, long now) {
+  int i;
+  sub->since = now;
+  for (i = 0; i < MAX_REGIONS; ++i) {
+    sub->seen[i] = now;
+    sub->next[i] = 0;
+    sub->armed[i] = !sub->opts.monitors;
+  }
+}
+
+/* Parse a complete subscription line: returns zero on a malformed one.
+   Options keep pointing into the line buffer, so it is left alone
+   afterward.
+ */
+static int
+subscribe_line(Subscriber * sub, long now) {
+  char * argv[MAX_ARGS];
+  int argc, i, j;
+  long t;
+
+  for (argc = 0, argv[0] = strtok(sub->line, " \t\r\n");
+       argv[argc] && argc < MAX_ARGS - 1;
+       argv[++argc] = strtok(NULL, " \t\r\n"));
+  if (!argc)
+    return 0;
+
+  if (!strcmp(argv[0], "inhibit") && argc == 1) {
+    sub->token = 1;
+    sub->nthres = 0;
+    ++ntokens;
+    debug("Inhibit token on fd %d\n", sub->fd);
+    return 1;
+  }
+
+  if (strcmp(argv[0], "watch"))
+    return 0;
+  memset(&sub->opts, 0, sizeof(Options));
+  for (sub->nthres = 0, i = 1; i < argc; ++i) {
+    if (*argv[i] == '-') {
+      if (!parse_option(&sub->opts, argc, argv, &i))
+	return 0;
+      continue;
+    }
+    if ((t = atol(argv[i])) <= 0 || t > 99999 || sub->nthres == MAX_THRESHOLDS)
+      return 0;
+    /* Keep thresholds sorted, as they will be reached in that order */
+    for (j = 0; j < sub->nthres && sub->thres[j] < t * TICKS_PER_SECOND; ++j);
+    memmove(&sub->thres[j + 1], &sub->thres[j],
+	    (sub->nthres++ - j) * sizeof(long));
+    sub->thres[j] = t * TICKS_PER_SECOND;
+  }
+  subscriber_reset(sub, now);
+  debug("Subscriber on fd %d: %d threshold(s)%s\n", sub->fd, sub->nthres,
+	(sub->opts.monitors)?", per monitor":"");
+  return 1;
+}
+
+static void
+subscriber_close(Subscriber * sub) {
+  if (sub->fd >= 0) {
+    close(sub->fd);
+    sub->fd = -1;
+  }
+  if (sub->token) {
+    sub->token = 0;
+    --ntokens;
+  }
+}
+
+/* Read what is available from a subscriber: returns zero if it is gone
+ */
+static int
+subscriber_read(Subscriber * sub, long now) {
+  char scratch[64];
+  int n;
+
+  if (sub->nthres >= 0) {
+    /* Already subscribed: anything else than EOF is ignored */
+    n = read(sub->fd, scratch, sizeof(scratch));
+    if (n > 0 || (n < 0 && errno == EINTR))
+      return 1;
+  } else {
+    n = read(sub->fd, &sub->line[sub->len], sizeof(sub->line) - sub->len - 1);
+    if (n > 0) {
+      sub->line[sub->len += n] = '\0';
+      if (!strchr(sub->line, '\n')) {
+	if (sub->len < sizeof(sub->line) - 1)
+	  return 1;
+      } else if (subscribe_line(sub, now))
+	return 1;
+      sub->nthres = -1;
+      notify(sub, "error\n");
+    } else if (n < 0 && errno == EINTR)
+      return 1;
+  }
+
+  subscriber_close(sub);
+  return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Check subscribers for reached thresholds: returns the next tick at which
+   a threshold may be reached. This is also the only place where inhibitors
+   get evaluated.
+ */
+static long
+service_scan(long now, long last, long * rlast) {
+  char msg[64];
+  long ref, deadline = LONG_MAX;
+  int i, j, n;
+  Subscriber * sub;
+
+#define REF(j) ((sub->opts.monitors)?rlast[j]:last)
+#define DUE(j) (sub->next[j] < sub->nthres && \
+		now - sub->seen[j] >= sub->thres[sub->next[j]])
+
+  for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+    sub = &subs[i];
+    if (sub->fd < 0 || sub->nthres < 0 || sub->token)
+      continue;
+    n = (sub->opts.monitors)?nregions:1;
+
+    /* Thresholds restart on every new activity period */
+    for (j = 0; j < n; ++j) {
+      ref = (REF(j) > sub->since)?REF(j):sub->since;
+      if (ref != sub->seen[j]) {
+	sub->seen[j] = ref;
+	sub->next[j] = 0;
+      }
+    }
+
+    for (j = 0; j < n && !DUE(j); ++j);
+    if (j < n && inhibited(&sub->opts, now)) {
+      debug("Subscriber on fd %d inhibited\n", sub->fd);
+      for (sub->since = now, j = 0; j < n; ++j) {
+	sub->seen[j] = now;
+	sub->next[j] = 0;
+      }
+    }
+
+    for (j = 0; j < n && sub->fd >= 0; ++j) {
+      ref = sub->seen[j];
+      while (DUE(j)) {
+	if (sub->opts.monitors)
+	  snprintf(msg, sizeof(msg), "idle %ld %s\n",
+		   sub->thres[sub->next[j]++] / TICKS_PER_SECOND,
+		   regions[j].name);
+	else
+	  snprintf(msg, sizeof(msg), "idle %ld\n",
+		   sub->thres[sub->next[j]++] / TICKS_PER_SECOND);
+	if (!notify(sub, msg))
+	  break;
+	sub->armed[j] = 1;
+      }
+
+      if (sub->fd >= 0 && sub->next[j] < sub->nthres &&
+	  ref + sub->thres[sub->next[j]] < deadline)
+	deadline = ref + sub->thres[sub->next[j]];
+    }
+  }
+#undef DUE
+#undef REF
+
+  return deadline;
+}
+
+/* Notify activity on the current monitor to armed subscribers
+ */
+static void
+service_activity(void) {
+  char msg[64];
+  int i;
+
+  for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+    if (subs[i].fd < 0 || subs[i].nthres < 0 || subs[i].token)
+      continue;
+    if (!subs[i].opts.monitors && subs[i].armed[0]) {
+      subs[i].armed[0] = 0;
+      notify(&subs[i], "active\n");
+    } else if (subs[i].opts.monitors && subs[i].armed[cur]) {
+      subs[i].armed[cur] = 0;
+      snprintf(msg, sizeof(msg), "active %s\n", regions[cur].name);
+      notify(&subs[i], msg);
+    }
+  }
+}
+
+static int
+service_armed(void) {
+  int i, j, n;
+  for (i = 0, n = 0; i < MAX_SUBSCRIBERS; ++i)
+    if (subs[i].fd >= 0 && subs[i].nthres >= 0 && !subs[i].token)
+      for (j = 0; j < ((subs[i].opts.monitors)?nregions:1); ++j)
+	n += subs[i].armed[j];
+  return n;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Service main loop: never returns but on error. X is polled once per tick,
+   whatever the number of subscribers; they are only looked at when a
+   threshold may have been reached, or when there is activity to report.
+
+   If a local subscription line is given, no socket is created and the
+   transitions are written on standard output instead: the loop then returns
+   when it cannot be written to anymore.
+ */
+static int
+serve(Display * dpy, char * local) {
+  struct sockaddr_un addr;
+  struct timeval start, tv;
+  fd_set fds;
+  long now, last, rlast[MAX_REGIONS], deadline, left;
+  int i, n, fd, sock = -1, maxfd, narmed;
+
+  for (i = 0; i < MAX_SUBSCRIBERS; ++i)
+    subs[i].fd = -1;
+
+  /* Gone subscribers get dropped on EPIPE, rather than killing us */
+  signal(SIGPIPE, SIG_IGN);
+
+  if (local) {
+    subs[0].fd = STDOUT_FILENO;
+    strncpy(subs[0].line, local, sizeof(subs[0].line) - 1);
+    if (!subscribe_line(&subs[0], 0))
+      die("invalid options\n");
+  } else {
+    if ((n = service_addr(&addr)) < 0)
+      die("could not compute the service address\n");
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	bind(sock, (struct sockaddr *)&addr, n) != 0 ||
+	listen(sock, 8) != 0)
+      die("could not listen on @%s: is a service already running?\n",
+	  &addr.sun_path[1]);
+    debug("Listening on @%s\n", &addr.sun_path[1]);
+  }
+
+  /* Subscribers may ask for it anytime: it is cheap enough */
+  if (!fullscreen_init(dpy))
+    die("could not allocate memory\n");
+
+  build_regions(dpy);
+#ifdef HAVE_XRANDR
+  for (i = 0; i < ScreenCount(dpy) && rr_event; ++i)
+    XRRSelectInput(dpy, RootWindow(dpy, i), RRScreenChangeNotifyMask);
+#endif
+  memset(rlast, 0, sizeof(rlast));
+
+  gettimeofday(&start, NULL);
+  for (now = last = 0, deadline = (local)?0:LONG_MAX, narmed = !!local;
+       !local || subs[0].fd >= 0;
+       ++now) {
+    /* Serve the sockets until the next tick is due */
+    for (;;) {
+      gettimeofday(&tv, NULL);
+      left = (start.tv_sec - tv.tv_sec) * 1000000 +
+	(start.tv_usec - tv.tv_usec) + (now + 1) * TICK;
+      /* Ticks missed while suspended are skipped, not polled in a row:
+	 the time spent asleep counts as idle */
+      if (left < -TICK)
+	now += -left / TICK;
+      if (left <= 0)
+	break;
+      tv.tv_sec = left / 1000000;
+      tv.tv_usec = left % 1000000;
+      if (local) {
+	select(0, NULL, NULL, NULL, &tv);
+	continue;
+      }
+
+      FD_ZERO(&fds);
+      FD_SET(sock, &fds);
+      for (i = 0, maxfd = sock; i < MAX_SUBSCRIBERS; ++i)
+	if (subs[i].fd >= 0) {
+	  FD_SET(subs[i].fd, &fds);
+	  if (subs[i].fd > maxfd) maxfd = subs[i].fd;
+	}
+      if ((n = select(maxfd + 1, &fds, NULL, NULL, &tv)) < 0) {
+	if (errno == EINTR) continue;
+	die("select failed\n");
+      }
+      if (n == 0)
+	break;
+
+      for (i = 0; i < MAX_SUBSCRIBERS; ++i)
+	if (subs[i].fd >= 0 && FD_ISSET(subs[i].fd, &fds) &&
+	    subs[i].nthres < 0) {
+	  if (subscriber_read(&subs[i], now) && subs[i].nthres >= 0 &&
+	      !subs[i].token) {
+	    narmed += !subs[i].opts.monitors;
+	    if (subs[i].nthres && now + subs[i].thres[0] < deadline)
+	      deadline = now + subs[i].thres[0];
+	  }
+	} else if (subs[i].fd >= 0 && FD_ISSET(subs[i].fd, &fds))
+	  subscriber_read(&subs[i], now);
+
+      if (FD_ISSET(sock, &fds) && (fd = accept(sock, NULL, NULL)) >= 0) {
+	for (i = 0; i < MAX_SUBSCRIBERS && subs[i].fd >= 0; ++i);
+	if (i < MAX_SUBSCRIBERS) {
+	  fcntl(fd, F_SETFL, O_NONBLOCK);
+	  subs[i].fd = fd;
+	  subs[i].len = 0;
+	  subs[i].token = 0;
+	  subs[i].nthres = -1;
+	  debug("New subscriber on fd %d\n", fd);
+	} else {
+	  /* Let the client fall back to polling by itself */
+	  if (write(fd, "busy\n", 5)) {}
+	  close(fd);
+	}
+      }
+    }
+
+    /* Then poll X, once for everybody: a layout change counts as activity
+       everywhere, since monitors may have been renumbered */
+    if (process_events(dpy)) {
+      for (i = 0; i < MAX_REGIONS; ++i)
+	rlast[i] = now;
+      last = deadline = now;
+    }
+    if (query_pointer(dpy) || query_keyboard(dpy)) {
+      /* First activity after a quiet period: thresholds have moved */
+      if (last != now - 1 || rlast[cur] != now - 1)
+	deadline = now;
+      last = rlast[cur] = now;
+      if (narmed) {
+	service_activity();
+	narmed = service_armed();
+      }
+    }
+
+    if (now >= deadline) {
+      deadline = service_scan(now, last, rlast);
+      narmed = service_armed();
+    }
+  }
+  return 0;
+
+fail:
+  return 2;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Connect to a running service, if any: returns -1 if there is none, the
+   connected socket otherwise.
+ */
+static int
+service_connect(void) {
+  struct sockaddr_un addr;
+  int n, fd;
+
+  if ((n = service_addr(&addr)) < 0 ||
+      (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, n) != 0) {
+    close(fd);
+    return -1;
+  }
+  debug("Connected to @%s\n", &addr.sun_path[1]);
+  return fd;
+}
+
+/* Subscribe to a running service, if any: returns -1 if there is none,
+   or if it went away before any verdict, the exit status otherwise. In
+   per-monitor mode, everything received is copied to standard output.
+ */
+static int
+subscribe(char * line, int monitors, int loopflag) {
+  int fd, len, r = -1;
+  FILE * f;
+
+  if ((fd = service_connect()) < 0)
+    return -1;
+
+  len = strlen(line);
+  if (write(fd, line, len) != len || !(f = fdopen(fd, "r"))) {
+    close(fd);
+    return -1;
+  }
+
+  while (fgets(line, LINE_SIZE, f)) {
+    debug("Service: %s", line);
+    if (!strncmp(line, "busy", 4)) {
+      r = -1;
+      break;
+    } else if (monitors) {
+      if (fputs(line, stdout) == EOF || fflush(stdout) == EOF) {
+	r = 0;
+	break;
+      }
+    } else if (!strncmp(line, "idle", 4)) {
+      r = 0;
+      break;
+    } else if (!strncmp(line, "active", 6) && !loopflag) {
+      r = 1;
+      break;
+    }
+  }
+
+  fclose(f);
+  return r;
+}
+
+/* Hold an inhibit token on the running service until killed
+ */
+static int
+hold_token(void) {
+  char buf[64];
+  int fd;
+
+  if ((fd = service_connect()) < 0)
+    die("no service running on this display\n");
+  if (write(fd, "inhibit\n", 8) != 8)
+    die("could not talk to the service\n");
+  while (read(fd, buf, sizeof(buf)) > 0);
+  die("service went away\n");
+
+fail:
+  return 2;
+}
+
 /*----------------------------------------------------------------------------*/
 int 
 main(int argc, char ** argv) {
-  int i, timeout, loopflag; // ox, oy, nx, ny;
+  int i, timeout, loopflag, serveflag, holdflag; // ox, oy, nx, ny;
+  int nthres, thres[MAX_THRESHOLDS];
+  long now;
+  char line[LINE_SIZE];
+  Options opts;
   Display * dpy;
   
   /* Parse command line */
   if (argc < 2)
-    die("Usage: %s [-w|--wait] timeout\n\n", argv[0]);
+    die("Usage: %s [-w|--wait] [-f] [-p process] [-i file] ... timeout\n"
+	"       %s -m|--monitors [-f] [-p process] [-i file] ... timeout ...\n"
+	"       %s -s|--serve\n"
+	"       %s -I|--inhibit\n\n", argv[0], argv[0], argv[0], argv[0]);
 
-  for (i = 1, timeout = -1, loopflag = 0; 
+  memset(&opts, 0, sizeof(Options));
+  for (i = 1, timeout = -1, nthres = 0,
+	 loopflag = serveflag = holdflag = 0; 
        i < argc; 
        ++i)
     if (*argv[i] == '-') {
-      if (argv[i][1] == 'w' || argv[i][1] == '-')
+      if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--wait"))
 	loopflag = 1;
-      else {
+      else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--serve"))
+	serveflag = 1;
+      else if (!strcmp(argv[i], "-I") || !strcmp(argv[i], "--inhibit"))
+	holdflag = 1;
+      else if (!parse_option(&opts, argc, argv, &i)) {
 	if (atoi(argv[i])!=0)
 	  die("timeout should be positive\n");
 	else
-	  die("unknwon flag '%s'\n", argv[i]);
+	  die("unknwon flag '%s', or missing argument\n", argv[i]);
       }
     } else {
       timeout = atoi(argv[i]);
       //if (timeout <= 0   ) die("timeout should be positive\n");
       if (timeout > 99999) die("large value of timeout: overflow?\n");
+      if (nthres == MAX_THRESHOLDS) die("too many timeouts\n");
+      thres[nthres++] = timeout;
       debug("timeout: %d\n", timeout);
     }
-  if (timeout == -1)
+  if ((serveflag || holdflag) &&
+      (argc != 2))
+    die("the --serve and --inhibit flags cannot be combined with anything\n");
+  if (holdflag)
+    return hold_token();
+  if (!serveflag && timeout == -1)
     die("timeout not specified\n");
   if (!timeout && loopflag)
     die("timeout of zero combined with the --wait flag cannot return\n");
-  
+  if (opts.monitors && (loopflag || !timeout))
+    die("the --monitors flag needs non-zero timeouts, and never returns\n");
+  if (!inhibitors_fix(&opts))
+    die("invalid inhibitor: process names and paths cannot contain "
+	"whitespace\n");
+
+  /* Let a running service do the polling, if any */
+  if (!serveflag) {
+    if (opts.monitors)
+      i = watch_line(line, sizeof(line), &opts, nthres, thres);
+    else
+      i = watch_line(line, sizeof(line), &opts, (timeout)?1:0, &timeout);
+    if (i < 0)
+      die("command line too long\n");
+    if ((i = subscribe(line, opts.monitors, loopflag)) >= 0)
+      return i;
+    if (opts.monitors)
+      watch_line(line, sizeof(line), &opts, nthres, thres);
+  }
+
   /* Prepare for operation */
       if (!(dpy=XOpenDisplay(NULL)))
     die("could not open display\n");
 
+  if (serveflag || opts.monitors)
+    return serve(dpy, (serveflag)?NULL:line);
+
+  if (opts.fullscreen && !fullscreen_init(dpy))
+    die("could not allocate memory\n");
+
   /* Main loop */
-  for(i = timeout * 10; !timeout || i; --i) {
-    usleep(100000);
+  for(i = timeout * 10, now = 0; !timeout || i; ++now) {
+    usleep(TICK);
+    process_events(dpy);
     if (query_pointer(dpy) || query_keyboard(dpy)) {
       if (loopflag)
 	i = timeout * 10;
       else 
 	break;
+    } else if (!--i && inhibited(&opts, now)) {
+      debug("Inhibited\n");
+      i = timeout * 10;
     }
   }
 
@@ -69,13 +69,10 @@ cleanup() {
     toggle_desktop off
     toggle_snow off
     toggle_rain off
+    test -n "${SERVICE}" && kill ${SERVICE} 2> /dev/null
     exit 0
 }
 
-detect_lplayer() {
-    ps -u ${USER} | grep -q lplayer
-}
-
 detect_block() {
     test `xquerypointer | gawk '{print $1}'` -eq 0
 }
@@ -86,9 +83,13 @@ trap 'cleanup' INT TERM EXIT
 
 xset dpms 0 600 900
 
+# Have all the xscriptsaver invocations below share a single X poller (this
+# fails harmlessly if some other script already started the service)
+xscriptsaver --serve 2> /dev/null &
+SERVICE=$!
+
 while : ; do
-    xscriptsaver --wait 60 && \
-	! detect_lplayer && \
+    xscriptsaver --wait --process lplayer 60 && \
 	! detect_block && {
 	# Stage 1: one minute of inactivity
 	toggle_rain on